@@ -24,6 +24,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <Windows.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <process.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <emmintrin.h>
+#if defined(_MSC_VER) && (_MSC_VER >= 1700)
+#define HAVE_AVX2
+#include <immintrin.h>
+#endif
+#define HAVE_SSE2
+#endif
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE	0x00098344 // Block cloning, Windows Server 2016 / Windows 10 on ReFS
+#endif
 
 // Global Definitions
 // *******************************************
@@ -35,19 +49,76 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define TEMP_BUFFER_LENGTH	65536
 #define FIRST_BLOCK_SIZE	65536 // Smallerblock size
 #define BLOCK_SIZE			4194304 // 4MB seems to be a good value for performance without too much memory load
+#define ROTATIONAL_BLOCK_SIZE	8388608 // Largest block on a rotational disk, fewer seeks between the files
+#define SSD_BLOCK_SIZE		4194304 // Largest block on a solid state disk, the reads in flight keep it busy
+#define REMOTE_BLOCK_SIZE	1048576 // Largest block on a network share
+#define BLOCK_GROWTH		4 // Factor the blocks grow by with every round the files still match
+#define GROUP_BUFFER_SIZE	67108864 // Address space shared by the mapped views of all files of a compared group
+#define BUFFER_BUDGET		256 // Memory (MB) of the unbuffered read buffers of all compare threads
+#define PREFILTER_BLOCK_SIZE	4096 // Size of the head, tail and sample chunks checked before the full compare
+#define PREFILTER_SAMPLES	3 // Number of interior chunks sampled for files larger than BLOCK_SIZE
+#define BATCH_FILE_SIZE		64 // Files up to this size (KB) are read whole in one batch per group and grouped in memory
+#define MAX_BATCH_FILE_SIZE	4096 // Upper limit (KB) of BATCH_FILE_SIZE, larger files are read block by block
+#define HASH_PRINT_COUNT	(2 + PREFILTER_SAMPLES) // Prefilter fingerprints kept per file: head, tail and samples
+#define HASH_DIGEST_SIZE	16 // Size of the full content hash in bytes
+#define BLAKE3_DIGEST_SIZE	32 // Size of a BLAKE3 digest in bytes
+#define BLAKE3_CHUNK_SIZE	1024 // Leaves of the BLAKE3 tree, hashed independently of each other
+#define BLAKE3_PARALLEL_CHUNKS	1024 // Chunks at least hashed by each helper thread
+#define HASH_DIGEST_VALID	0x80000000 // Flag of an index record holding a full content hash
+#define INDEX_VERSION		1
+#define INDEX_FLUSH_RECORDS	4096 // New index records are written in batches of this size
+#define INDEX_COMPACT_MIN	4096 // Index files with fewer records are never compacted
 #define MIN_FILE_SIZE		1024 // Minimum file size so that hard linking will be checked...
+#define MAX_THREADS			256 // Upper limit for the number of worker threads
+#define SSD_QUEUE_DEPTH		32 // Reads in flight on a device without seek penalty
+#define ROTATIONAL_QUEUE_DEPTH	1 // Reads in flight on a rotational disk, more just cause head movements
+#define REMOTE_QUEUE_DEPTH	8 // Reads in flight on a network share
+#define READ_AHEAD			2 // Reads in flight per file while comparing, 2 = double buffering
+#define MAX_READ_AHEAD		16
+#define MAP_THRESHOLD		16 // Files up to this size (MB) are compared through memory mapped views
+#define COMPARE_FAILED		((size_t)-1) // Result of a compare kernel hitting an in-page error
+#define NO_FOLDER			0xFFFFFFFF // Parent id of the paths to process
+#define DIRECTORY_BUFFER_SIZE	262144 // Buffer for the folder entries read at once
+#define FOLDER_CACHE_SIZE	64 // Folder handles kept open per compare thread, more if one group needs them
+#define CLONE_BATCH_SIZE	64 // Size (MB) of the ranges cloned with one call
+#define JOURNAL_BATCH		4096 // Links journaled and flushed at once, linked in parallel by folder
+#define BENCHMARK_FOLDERS	16 // Folders of the synthetic tree of the link benchmark
+#define BENCHMARK_FILES		256 // Files per folder of the link benchmark
+#define JOURNAL_FILE		L"DFHL.journal" // Default journal of the link phase
+#define RUN_BUFFER_SIZE		262144 // Buffer for writing a run file, upper limit for reading one
+#define MIN_MEMORY_LIMIT	16 // Lowest memory limit (MB) of the file table
+#define THROTTLE_CHECK		1000 // Interval (ms) the control file of the limits is checked in
+#define NO_LOCATION			-1 // First cluster of a file without clusters of its own, same as the LCN of a sparse extent
 
 #define PROGRAM_NAME		L"Duplicate File Hard Linker"
 #define PROGRAM_VERSION     L"Version 1.2a"
 #define PROGRAM_AUTHOR      L"Jens Scheffler and Oliver Schneider, http://www.jensscheffler.de"
 
 enum CompareResult {
-	EQUAL,			// File compare was successful and content is matching
+	EQUAL,			// File compare was successful and content is matching (so far)
 	SAME,			// Files are already hard linked
 	SKIP,			// Files should not be processed (filter!)
 	DIFFERENT		// Files differ
 };
 
+enum TargetPolicy {
+	MOST_LINKS,		// The file with the most hard links is kept, large link sets are not broken up
+	OLDEST,			// The file with the oldest last write time is kept
+	PREFERRED_ROOT	// A file below the preferred root is kept, ties by the number of hard links
+};
+
+enum HashMethod {
+	NO_HASH,		// Files are compared byte by byte
+	MURMUR_HASH,	// Files are grouped by their 128 bit MurmurHash3, the hash of the index
+	BLAKE3_HASH		// Files are grouped by their 256 bit BLAKE3 hash
+};
+
+enum EnumerationMethod {
+	FIND_FILES,			// FindFirstFile/FindNextFile by path, one entry per call
+	FILE_ID_BOTH_INFO,	// GetFileInformationByHandleEx, entries in batches with their file id and short name
+	FILE_ID_FULL_INFO	// NtQueryDirectoryFile, entries in batches with their file id, no short names looked up
+};
+
 namespace
 {
 	// Global Variables
@@ -58,23 +129,32 @@ namespace
 	bool outputList = false;
 	/** Flag if running in real or test mode */
 	bool reallyLink = false;
+	/** Flag if links left incomplete in the journal should be recovered */
+	bool recoverJournal = false;
+	bool linkBenchmark = false;
+	bool walkBenchmark = false;
+	bool kernelBenchmark = false;
 
 	// Global Code
 	// *******************************************
 	/**
-	* Method to log a message to stdout/stderr
+	* Method to log a message to stdout/stderr. Each line is written while
+	* holding the lock of the stream, so lines of concurrent threads don't mix.
 	*/
 	void logError(LPCWSTR message, ...) {
 		va_list argp;
+		_lock_file(stderr);
 		fwprintf(stderr, L"ERROR: ");
 		va_start(argp, message);
 		vfwprintf(stderr, message, argp);
 		va_end(argp);
 		fwprintf(stderr, L"\n");
+		_unlock_file(stderr);
 	}
 
 	void logError(DWORD errNumber, LPCWSTR message, ...) {
 		va_list argp;
+		_lock_file(stderr);
 		fwprintf(stderr, L"ERROR: ");
 		va_start(argp, message);
 		vfwprintf(stderr, message, argp);
@@ -89,38 +169,582 @@ namespace
 			0,
 			NULL);
 		fwprintf(stderr, L" -> [%i] %s\n", errNumber, msgBuffer);
+		_unlock_file(stderr);
 		LocalFree(msgBuffer);
 	}
 
 	void logInfo(LPCWSTR message, ...) {
 		if (logLevel <= LOG_INFO) {
 			va_list argp;
+			_lock_file(stdout);
 			va_start(argp, message);
 			vwprintf(message, argp);
 			va_end(argp);
 			wprintf(L"\n");
+			_unlock_file(stdout);
 		}
 	}
 
 	void logVerbose(LPCWSTR message, ...) {
 		if (logLevel <= LOG_VERBOSE) {
 			va_list argp;
+			_lock_file(stdout);
 			wprintf(L"  ");
 			va_start(argp, message);
 			vwprintf(message, argp);
 			va_end(argp);
 			wprintf(L"\n");
+			_unlock_file(stdout);
 		}
 	}
 	void logDebug(LPCWSTR message, ...) {
 		if (logLevel <= LOG_DEBUG) {
 			va_list argp;
+			_lock_file(stdout);
 			wprintf(L"    ");
 			va_start(argp, message);
 			vwprintf(message, argp);
 			va_end(argp);
 			wprintf(L"\n");
+			_unlock_file(stdout);
+		}
+	}
+
+	/**
+	* Calculates a fingerprint (64 bit FNV-1a) of a small chunk of file data
+	*/
+	UINT64 fingerprint(const BYTE* data, DWORD length) {
+		UINT64 hash = 14695981039346656037ULL;
+		for (DWORD i = 0; i < length; i++) {
+			hash ^= data[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	/**
+	* Portable compare kernel, compares word by word
+	* @return offset of the first differing byte, length if the blocks are equal
+	*/
+	size_t compareBlocksPortable(const BYTE* block1, const BYTE* block2, size_t length) {
+		size_t i = 0;
+		for (; i + sizeof(size_t) <= length; i += sizeof(size_t)) {
+			if (*(const size_t*)(block1 + i) != *(const size_t*)(block2 + i)) {
+				break;
+			}
+		}
+		for (; i < length; i++) {
+			if (block1[i] != block2[i]) {
+				return i;
+			}
+		}
+		return length;
+	}
+
+#ifdef HAVE_SSE2
+	/**
+	* SSE2 compare kernel, compares 64 bytes per iteration
+	*/
+	size_t compareBlocksSse2(const BYTE* block1, const BYTE* block2, size_t length) {
+		size_t i = 0;
+		for (; i + 64 <= length; i += 64) {
+			__m128i eq = _mm_and_si128(
+				_mm_and_si128(
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(block1 + i)), _mm_loadu_si128((const __m128i*)(block2 + i))),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(block1 + i + 16)), _mm_loadu_si128((const __m128i*)(block2 + i + 16)))),
+				_mm_and_si128(
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(block1 + i + 32)), _mm_loadu_si128((const __m128i*)(block2 + i + 32))),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(block1 + i + 48)), _mm_loadu_si128((const __m128i*)(block2 + i + 48)))));
+			if (_mm_movemask_epi8(eq) != 0xFFFF) {
+				break;
+			}
+		}
+		for (; i + 16 <= length; i += 16) {
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(block1 + i)), _mm_loadu_si128((const __m128i*)(block2 + i))));
+			if (mask != 0xFFFF) {
+				unsigned long bit;
+				_BitScanForward(&bit, ~mask & 0xFFFF);
+				return i + bit;
+			}
+		}
+		return i + compareBlocksPortable(block1 + i, block2 + i, length - i);
+	}
+#endif
+
+#ifdef HAVE_AVX2
+	/**
+	* AVX2 compare kernel, compares 128 bytes per iteration
+	*/
+	size_t compareBlocksAvx2(const BYTE* block1, const BYTE* block2, size_t length) {
+		size_t i = 0;
+		for (; i + 128 <= length; i += 128) {
+			__m256i eq = _mm256_and_si256(
+				_mm256_and_si256(
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(block1 + i)), _mm256_loadu_si256((const __m256i*)(block2 + i))),
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(block1 + i + 32)), _mm256_loadu_si256((const __m256i*)(block2 + i + 32)))),
+				_mm256_and_si256(
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(block1 + i + 64)), _mm256_loadu_si256((const __m256i*)(block2 + i + 64))),
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(block1 + i + 96)), _mm256_loadu_si256((const __m256i*)(block2 + i + 96)))));
+			if (_mm256_movemask_epi8(eq) != -1) {
+				break;
+			}
+		}
+		for (; i + 32 <= length; i += 32) {
+			unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(block1 + i)), _mm256_loadu_si256((const __m256i*)(block2 + i))));
+			if (mask != 0xFFFFFFFF) {
+				unsigned long bit;
+				_BitScanForward(&bit, ~mask);
+				return i + bit;
+			}
+		}
+		_mm256_zeroupper();
+		return i + compareBlocksSse2(block1 + i, block2 + i, length - i);
+	}
+#endif
+
+	/** BLAKE3 initialization vector, the same as the one of SHA-256 */
+	const UINT32 blake3Iv[8] = {
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+	};
+
+	/** Order of the message words in the seven rounds of the BLAKE3 compression */
+	const BYTE blake3Schedule[7][16] = {
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+		{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+		{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+		{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+		{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+		{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+		{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+	};
+
+	/** Domain flags of the BLAKE3 compression */
+	const UINT32 BLAKE3_CHUNK_START = 1;
+	const UINT32 BLAKE3_CHUNK_END = 2;
+	const UINT32 BLAKE3_PARENT = 4;
+	const UINT32 BLAKE3_ROOT = 8;
+
+	inline UINT32 rotr32(UINT32 x, int n) {
+		return (x >> n) | (x << (32 - n));
+	}
+
+	inline void blake3G(UINT32* v, int a, int b, int c, int d, UINT32 x, UINT32 y) {
+		v[a] += v[b] + x;
+		v[d] = rotr32(v[d] ^ v[a], 16);
+		v[c] += v[d];
+		v[b] = rotr32(v[b] ^ v[c], 12);
+		v[a] += v[b] + y;
+		v[d] = rotr32(v[d] ^ v[a], 8);
+		v[c] += v[d];
+		v[b] = rotr32(v[b] ^ v[c], 7);
+	}
+
+	/**
+	* BLAKE3 compression of one 64 byte block
+	* @param out Filled with the 16 output words, the first 8 are the new chaining value
+	*/
+	void blake3Compress(const UINT32 cv[8], const UINT32 block[16], UINT64 counter, UINT32 blockLength, UINT32 flags, UINT32 out[16]) {
+		UINT32 v[16];
+		memcpy(v, cv, 32);
+		memcpy(v + 8, blake3Iv, 16);
+		v[12] = (UINT32)counter;
+		v[13] = (UINT32)(counter >> 32);
+		v[14] = blockLength;
+		v[15] = flags;
+		for (int r = 0; r < 7; r++) {
+			const BYTE* m = blake3Schedule[r];
+			blake3G(v, 0, 4, 8, 12, block[m[0]], block[m[1]]);
+			blake3G(v, 1, 5, 9, 13, block[m[2]], block[m[3]]);
+			blake3G(v, 2, 6, 10, 14, block[m[4]], block[m[5]]);
+			blake3G(v, 3, 7, 11, 15, block[m[6]], block[m[7]]);
+			blake3G(v, 0, 5, 10, 15, block[m[8]], block[m[9]]);
+			blake3G(v, 1, 6, 11, 12, block[m[10]], block[m[11]]);
+			blake3G(v, 2, 7, 8, 13, block[m[12]], block[m[13]]);
+			blake3G(v, 3, 4, 9, 14, block[m[14]], block[m[15]]);
+		}
+		for (int i = 0; i < 8; i++) {
+			out[i + 8] = v[i + 8] ^ cv[i];
+			out[i] = v[i] ^ v[i + 8];
+		}
+	}
+
+	/**
+	* Portable chunk kernel, hashes whole chunks one after the other
+	* @param counter Number of the first chunk in the file
+	* @param cvs Filled with the chaining value of each chunk
+	*/
+	void blake3HashChunksPortable(const BYTE* input, size_t count, UINT64 counter, UINT32 (*cvs)[8]) {
+		for (size_t c = 0; c < count; c++) {
+			UINT32 cv[8];
+			memcpy(cv, blake3Iv, 32);
+			for (int b = 0; b < BLAKE3_CHUNK_SIZE / 64; b++) {
+				UINT32 block[16];
+				UINT32 out[16];
+				memcpy(block, input + c * BLAKE3_CHUNK_SIZE + b * 64, 64);
+				UINT32 flags = (b == 0 ? BLAKE3_CHUNK_START : 0) | (b == BLAKE3_CHUNK_SIZE / 64 - 1 ? BLAKE3_CHUNK_END : 0);
+				blake3Compress(cv, block, counter + c, 64, flags, out);
+				memcpy(cv, out, 32);
+			}
+			memcpy(cvs[c], cv, 32);
+		}
+	}
+
+#ifdef HAVE_SSE2
+	inline __m128i rotr16(__m128i x) {
+		return _mm_or_si128(_mm_srli_epi32(x, 16), _mm_slli_epi32(x, 16));
+	}
+
+	inline __m128i rotr12(__m128i x) {
+		return _mm_or_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(x, 20));
+	}
+
+	inline __m128i rotr8(__m128i x) {
+		return _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 24));
+	}
+
+	inline __m128i rotr7(__m128i x) {
+		return _mm_or_si128(_mm_srli_epi32(x, 7), _mm_slli_epi32(x, 25));
+	}
+
+	inline void blake3G4(__m128i* v, int a, int b, int c, int d, __m128i x, __m128i y) {
+		v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+		v[d] = rotr16(_mm_xor_si128(v[d], v[a]));
+		v[c] = _mm_add_epi32(v[c], v[d]);
+		v[b] = rotr12(_mm_xor_si128(v[b], v[c]));
+		v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+		v[d] = rotr8(_mm_xor_si128(v[d], v[a]));
+		v[c] = _mm_add_epi32(v[c], v[d]);
+		v[b] = rotr7(_mm_xor_si128(v[b], v[c]));
+	}
+
+	/**
+	* Transposes four vectors of four words, row i becomes column i
+	*/
+	inline void transpose4(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+		__m128i ab01 = _mm_unpacklo_epi32(a, b);
+		__m128i ab23 = _mm_unpackhi_epi32(a, b);
+		__m128i cd01 = _mm_unpacklo_epi32(c, d);
+		__m128i cd23 = _mm_unpackhi_epi32(c, d);
+		a = _mm_unpacklo_epi64(ab01, cd01);
+		b = _mm_unpackhi_epi64(ab01, cd01);
+		c = _mm_unpacklo_epi64(ab23, cd23);
+		d = _mm_unpackhi_epi64(ab23, cd23);
+	}
+
+	/**
+	* SSE2 chunk kernel, hashes four chunks at once with one chunk per lane
+	*/
+	void blake3HashChunksSse2(const BYTE* input, size_t count, UINT64 counter, UINT32 (*cvs)[8]) {
+		size_t c = 0;
+		for (; c + 4 <= count; c += 4) {
+			const BYTE* chunk = input + c * BLAKE3_CHUNK_SIZE;
+			__m128i h[8];
+			for (int i = 0; i < 8; i++) {
+				h[i] = _mm_set1_epi32((int)blake3Iv[i]);
+			}
+			__m128i counterLow = _mm_set_epi32((int)(UINT32)(counter + c + 3), (int)(UINT32)(counter + c + 2), (int)(UINT32)(counter + c + 1), (int)(UINT32)(counter + c));
+			__m128i counterHigh = _mm_set_epi32((int)(UINT32)((counter + c + 3) >> 32), (int)(UINT32)((counter + c + 2) >> 32),
+				(int)(UINT32)((counter + c + 1) >> 32), (int)(UINT32)((counter + c) >> 32));
+			for (int b = 0; b < BLAKE3_CHUNK_SIZE / 64; b++) {
+				// word i of the block of each chunk in the lanes of m[i]
+				__m128i m[16];
+				for (int q = 0; q < 4; q++) {
+					for (int lane = 0; lane < 4; lane++) {
+						m[4 * q + lane] = _mm_loadu_si128((const __m128i*)(chunk + lane * BLAKE3_CHUNK_SIZE + b * 64 + q * 16));
+					}
+					transpose4(m[4 * q], m[4 * q + 1], m[4 * q + 2], m[4 * q + 3]);
+				}
+				UINT32 flags = (b == 0 ? BLAKE3_CHUNK_START : 0) | (b == BLAKE3_CHUNK_SIZE / 64 - 1 ? BLAKE3_CHUNK_END : 0);
+				__m128i v[16];
+				for (int i = 0; i < 8; i++) {
+					v[i] = h[i];
+				}
+				for (int i = 0; i < 4; i++) {
+					v[8 + i] = _mm_set1_epi32((int)blake3Iv[i]);
+				}
+				v[12] = counterLow;
+				v[13] = counterHigh;
+				v[14] = _mm_set1_epi32(64);
+				v[15] = _mm_set1_epi32((int)flags);
+				for (int r = 0; r < 7; r++) {
+					const BYTE* s = blake3Schedule[r];
+					blake3G4(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+					blake3G4(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+					blake3G4(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+					blake3G4(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+					blake3G4(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+					blake3G4(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+					blake3G4(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+					blake3G4(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+				}
+				for (int i = 0; i < 8; i++) {
+					h[i] = _mm_xor_si128(v[i], v[i + 8]);
+				}
+			}
+			transpose4(h[0], h[1], h[2], h[3]);
+			transpose4(h[4], h[5], h[6], h[7]);
+			for (int lane = 0; lane < 4; lane++) {
+				_mm_storeu_si128((__m128i*)cvs[c + lane], h[lane]);
+				_mm_storeu_si128((__m128i*)(cvs[c + lane] + 4), h[4 + lane]);
+			}
+		}
+		blake3HashChunksPortable(input + c * BLAKE3_CHUNK_SIZE, count - c, counter + c, cvs + c);
+	}
+#endif
+
+	typedef void (*ChunkKernel)(const BYTE* input, size_t count, UINT64 counter, UINT32 (*cvs)[8]);
+
+	/** BLAKE3 chunk kernel selected for this CPU */
+	ChunkKernel hashChunks = blake3HashChunksPortable;
+
+	typedef size_t (*CompareKernel)(const BYTE* block1, const BYTE* block2, size_t length);
+
+	/** Compare kernel selected for this CPU */
+	CompareKernel compareBlocks = compareBlocksPortable;
+	LPCWSTR compareKernelName = L"portable";
+
+	/**
+	* Selects the fastest compare kernel supported by CPU and operating system
+	*/
+	void selectCompareKernel() {
+#ifdef HAVE_SSE2
+		int info[4];
+		__cpuid(info, 1);
+		if (info[3] & (1 << 26)) {
+			compareBlocks = compareBlocksSse2;
+			compareKernelName = L"SSE2";
+			hashChunks = blake3HashChunksSse2;
+		}
+#ifdef HAVE_AVX2
+		// AVX needs OS support for saving the YMM registers (OSXSAVE + XCR0)
+		if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+			__cpuidex(info, 7, 0);
+			if (info[1] & (1 << 5)) {
+				compareBlocks = compareBlocksAvx2;
+				compareKernelName = L"AVX2";
+			}
+		}
+#endif
+#endif
+		logDebug(L"Using %s compare kernel", compareKernelName);
+	}
+
+	/**
+	* Measures the throughput of all compare kernels for the block sizes used
+	*/
+	void benchmarkCompareKernels() {
+		CompareKernel kernels[3];
+		LPCWSTR names[3];
+		int kernelCount = 0;
+		kernels[kernelCount] = compareBlocksPortable;
+		names[kernelCount++] = L"portable";
+#ifdef HAVE_SSE2
+		kernels[kernelCount] = compareBlocksSse2;
+		names[kernelCount++] = L"SSE2";
+#endif
+#ifdef HAVE_AVX2
+		if (compareBlocks == compareBlocksAvx2) {
+			kernels[kernelCount] = compareBlocksAvx2;
+			names[kernelCount++] = L"AVX2";
+		}
+#endif
+		LPBYTE block1 = (LPBYTE)VirtualAlloc(NULL, BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		LPBYTE block2 = (LPBYTE)VirtualAlloc(NULL, BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (block1 == NULL || block2 == NULL) {
+			logError(GetLastError(), L"Unable to allocate benchmark buffers.");
+		} else {
+			memset(block1, 0x5A, BLOCK_SIZE);
+			memset(block2, 0x5A, BLOCK_SIZE);
+			LARGE_INTEGER frequency;
+			QueryPerformanceFrequency(&frequency);
+			DWORD blockSizes[2] = { FIRST_BLOCK_SIZE, BLOCK_SIZE };
+			for (int k = 0; k < kernelCount; k++) {
+				for (int b = 0; b < 2; b++) {
+					// compare 256MB of equal data, so the whole blocks have to be checked
+					int rounds = 268435456 / blockSizes[b];
+					size_t checked = 0;
+					LARGE_INTEGER start;
+					LARGE_INTEGER end;
+					QueryPerformanceCounter(&start);
+					for (int r = 0; r < rounds; r++) {
+						checked += kernels[k](block1, block2, blockSizes[b]);
+					}
+					QueryPerformanceCounter(&end);
+					INT64 ticks = end.QuadPart - start.QuadPart;
+					logInfo(L"%s compare kernel, %i KB blocks: %I64i MB/s", names[k], blockSizes[b] / 1024,
+						ticks > 0 ? (INT64)checked * frequency.QuadPart / ticks / 1048576 : 0);
+				}
+			}
+		}
+		if (block1 != NULL) {
+			VirtualFree(block1, 0, MEM_RELEASE);
+		}
+		if (block2 != NULL) {
+			VirtualFree(block2, 0, MEM_RELEASE);
+		}
+	}
+
+	typedef unsigned (__stdcall *ThreadProc)(void* param);
+
+	/**
+	* Runs the thread procedure once for each of the parameters in its own
+	* thread and waits until all threads are done. If a thread can't be
+	* started, the calling thread processes its parameter afterwards.
+	*/
+	void runThreads(ThreadProc proc, void** params, int count) {
+		HANDLE* threads = new HANDLE[count];
+		for (int i = 0; i < count; i++) {
+			threads[i] = (HANDLE)_beginthreadex(NULL, 0, proc, params[i], 0, NULL);
+			if (threads[i] == 0) {
+				logError(GetLastError(), L"Unable to start worker thread.");
+			}
+		}
+		for (int i = 0; i < count; i++) {
+			if (threads[i] != 0) {
+				WaitForSingleObject(threads[i], INFINITE);
+				CloseHandle(threads[i]);
+			}
+		}
+		for (int i = 0; i < count; i++) {
+			if (threads[i] == 0) {
+				proc(params[i]);
+			}
+		}
+		delete[] threads;
+	}
+
+	/**
+	* Reallocates the array with a new capacity, keeping the first count elements
+	*/
+	template <class T> T* resizeArray(T* items, size_t count, size_t capacity) {
+		T* newItems = new T[capacity];
+		if (items != NULL) {
+			memcpy(newItems, items, count * sizeof(T));
+			delete[] items;
+		}
+		return newItems;
+	}
+
+	// Native API for file operations relative to a folder handle, the
+	// structures are missing in the SDK headers
+	// *******************************************
+	struct NtUnicodeString {
+		USHORT Length;
+		USHORT MaximumLength;
+		PWSTR Buffer;
+	};
+
+	struct NtObjectAttributes {
+		ULONG Length;
+		HANDLE RootDirectory;
+		NtUnicodeString* ObjectName;
+		ULONG Attributes;
+		PVOID SecurityDescriptor;
+		PVOID SecurityQualityOfService;
+	};
+
+	struct NtIoStatusBlock {
+		LONG_PTR Status;
+		ULONG_PTR Information;
+	};
+
+	/** Layout of FILE_LINK_INFORMATION and FILE_RENAME_INFORMATION */
+	struct NtLinkInformation {
+		BOOLEAN ReplaceIfExists;
+		HANDLE RootDirectory;
+		ULONG FileNameLength;
+		WCHAR FileName[1];
+	};
+
+	enum {
+		NT_FILE_RENAME_INFORMATION = 10,
+		NT_FILE_LINK_INFORMATION = 11,
+		NT_FILE_ID_FULL_DIRECTORY_INFORMATION = 38,
+		NT_FILE_DIRECTORY_FILE = 0x1,
+		NT_FILE_SEQUENTIAL_ONLY = 0x4,
+		NT_FILE_NO_INTERMEDIATE_BUFFERING = 0x8,
+		NT_FILE_SYNCHRONOUS_IO_NONALERT = 0x20,
+		NT_FILE_NON_DIRECTORY_FILE = 0x40,
+		NT_FILE_OPEN_FOR_BACKUP_INTENT = 0x4000,
+		NT_OBJ_CASE_INSENSITIVE = 0x40
+	};
+	const LONG NT_STATUS_ACCESS_DENIED = (LONG)0xC0000022;
+	const LONG NT_STATUS_NO_MORE_FILES = (LONG)0x80000006;
+	const LONG NT_STATUS_NO_SUCH_FILE = (LONG)0xC000000F;
+
+	typedef LONG (WINAPI *NtSetInformationFileProc)(HANDLE FileHandle, NtIoStatusBlock* IoStatusBlock, PVOID FileInformation, ULONG Length, int FileInformationClass);
+	typedef LONG (WINAPI *NtOpenFileProc)(HANDLE* FileHandle, ACCESS_MASK DesiredAccess, NtObjectAttributes* ObjectAttributes, NtIoStatusBlock* IoStatusBlock, ULONG ShareAccess, ULONG OpenOptions);
+	typedef ULONG (WINAPI *RtlNtStatusToDosErrorProc)(LONG Status);
+	typedef LONG (WINAPI *NtQueryDirectoryFileProc)(HANDLE FileHandle, HANDLE Event, PVOID ApcRoutine, PVOID ApcContext, NtIoStatusBlock* IoStatusBlock, PVOID FileInformation, ULONG Length, int FileInformationClass, BOOLEAN ReturnSingleEntry, NtUnicodeString* FileName, BOOLEAN RestartScan);
+	NtSetInformationFileProc ntSetInformationFile = NULL;
+	NtOpenFileProc ntOpenFile = NULL;
+	RtlNtStatusToDosErrorProc rtlNtStatusToDosError = NULL;
+	NtQueryDirectoryFileProc ntQueryDirectoryFile = NULL;
+
+	/**
+	* Loads the native API functions used, they stay NULL if not available
+	*/
+	void loadNativeApi() {
+		HMODULE ntdll = GetModuleHandle(L"ntdll.dll");
+		if (ntdll != NULL) {
+			ntSetInformationFile = (NtSetInformationFileProc)GetProcAddress(ntdll, "NtSetInformationFile");
+			ntOpenFile = (NtOpenFileProc)GetProcAddress(ntdll, "NtOpenFile");
+			rtlNtStatusToDosError = (RtlNtStatusToDosErrorProc)GetProcAddress(ntdll, "RtlNtStatusToDosError");
+			ntQueryDirectoryFile = (NtQueryDirectoryFileProc)GetProcAddress(ntdll, "NtQueryDirectoryFile");
+		}
+	}
+
+	/**
+	* Sets the name relative to the folder handle into the native structures
+	*/
+	void initObjectAttributes(NtObjectAttributes& attributes, NtUnicodeString& name, HANDLE hFolder, LPCWSTR fileName) {
+		name.Length = name.MaximumLength = (USHORT)(wcslen(fileName) * sizeof(WCHAR));
+		name.Buffer = (PWSTR)fileName;
+		attributes.Length = sizeof(attributes);
+		attributes.RootDirectory = hFolder;
+		attributes.ObjectName = &name;
+		attributes.Attributes = NT_OBJ_CASE_INSENSITIVE;
+		attributes.SecurityDescriptor = NULL;
+		attributes.SecurityQualityOfService = NULL;
+	}
+
+	/**
+	* Opens an existing file or folder relative to the folder handle, like
+	* CreateFile the error is given by GetLastError()
+	* @param options NT_FILE_* open options
+	* @return handle, INVALID_HANDLE_VALUE on errors
+	*/
+	HANDLE openRelative(HANDLE hFolder, LPCWSTR fileName, ACCESS_MASK access, ULONG share, ULONG options) {
+		NtUnicodeString name;
+		NtObjectAttributes attributes;
+		initObjectAttributes(attributes, name, hFolder, fileName);
+		NtIoStatusBlock status;
+		HANDLE hFile;
+		LONG result = ntOpenFile(&hFile, access, &attributes, &status, share, options);
+		if (result < 0) {
+			SetLastError(rtlNtStatusToDosError != NULL ? rtlNtStatusToDosError(result) : ERROR_ACCESS_DENIED);
+			return INVALID_HANDLE_VALUE;
 		}
+		return hFile;
+	}
+
+	/**
+	* Links or renames the file to a name relative to the folder handle
+	* @param infoClass NT_FILE_LINK_INFORMATION or NT_FILE_RENAME_INFORMATION
+	* @return NTSTATUS of the operation, negative on errors
+	*/
+	LONG setNameRelative(HANDLE hFile, int infoClass, HANDLE hFolder, LPCWSTR fileName, bool replace) {
+		ULONG nameLength = (ULONG)(wcslen(fileName) * sizeof(WCHAR));
+		ULONG length = (ULONG)offsetof(NtLinkInformation, FileName) + nameLength;
+		NtLinkInformation* info = (NtLinkInformation*)new BYTE[length + sizeof(WCHAR)];
+		info->ReplaceIfExists = replace;
+		info->RootDirectory = hFolder;
+		info->FileNameLength = nameLength;
+		memcpy(info->FileName, fileName, nameLength);
+		NtIoStatusBlock status;
+		LONG result = ntSetInformationFile(hFile, &status, info, length, infoClass);
+		delete[] (BYTE*)info;
+		return result;
 	}
 
 	// We ignore the third parameter
@@ -171,6 +795,25 @@ public:
 		append(data);
 	}
 
+	/**
+	* Moves all items of the other collection to the end of this one
+	*/
+	void appendAll(Collection* other) {
+		if (other->root == NULL) {
+			return;
+		}
+		if (root != NULL) {
+			last->next = other->root;
+		} else {
+			root = other->root;
+		}
+		last = other->last;
+		itemCount += other->itemCount;
+		nextItem = root;
+		other->root = other->last = other->nextItem = NULL;
+		other->itemCount = 0;
+	}
+
 	void* pop() {
 		if (root != NULL) {
 			Item* temp = root;
@@ -247,6 +890,10 @@ public:
 		col->push(p);
 	}
 
+	int getSize() {
+		return col->getSize();
+	}
+
 	bool pop(LPWSTR item) {
 		if (col->getSize() > 0) {
 			PathItem* p = (PathItem*)col->pop();
@@ -267,163 +914,4344 @@ public:
 	}
 };
 
-class Files {
+/**
+* Double ended queue shared between threads. The owning thread works at the
+* back, idle threads steal from the front.
+*/
+class WorkQueue {
 private:
-	class FileItem {
-	public:
-		LPWSTR name;
-		INT64 size;
+	void** items;
+	int capacity;
+	int head;
+	int count;
+	CRITICAL_SECTION lock;
+
+	void grow() {
+		void** newItems = new void*[capacity * 2];
+		for (int i = 0; i < count; i++) {
+			newItems[i] = items[(head + i) % capacity];
+		}
+		delete[] items;
+		items = newItems;
+		capacity *= 2;
+		head = 0;
+	}
+public:
+	void pushBack(void* item) {
+		EnterCriticalSection(&lock);
+		if (count == capacity) {
+			grow();
+		}
+		items[(head + count) % capacity] = item;
+		count++;
+		LeaveCriticalSection(&lock);
+	}
 
-		FileItem(LPCWSTR newName, INT64 newSize) {
-			name = new wchar_t[wcslen(newName)+1];
-			wcscpy(name, newName);
-			size = newSize;
+	void* popBack() {
+		void* result = NULL;
+		EnterCriticalSection(&lock);
+		if (count > 0) {
+			count--;
+			result = items[(head + count) % capacity];
 		}
+		LeaveCriticalSection(&lock);
+		return result;
+	}
 
-		~FileItem() {
-			delete name;
+	void* popFront() {
+		void* result = NULL;
+		EnterCriticalSection(&lock);
+		if (count > 0) {
+			result = items[head];
+			head = (head + 1) % capacity;
+			count--;
 		}
-	};
-	Collection* col;
-public:
-	void add(LPCWSTR item, INT64 size) {
-		FileItem* f = new FileItem(item, size);
-		col->push(f);
+		LeaveCriticalSection(&lock);
+		return result;
 	}
 
-	bool pop(LPWSTR item, INT64& size) {
-		if (col->getSize() > 0) {
-			FileItem* f = (FileItem*)col->pop();
-			wcscpy(item, f->name);
-			size = f->size;
-			delete f;
-			return true;
-		} else {
-			return false;
+	WorkQueue() {
+		capacity = 64;
+		items = new void*[capacity];
+		head = count = 0;
+		InitializeCriticalSection(&lock);
+	}
+
+	~WorkQueue() {
+		DeleteCriticalSection(&lock);
+		delete[] items;
+	}
+};
+
+/**
+* Storage for names, appended one after another and referenced by their offset
+*/
+class NameArena {
+private:
+	LPWSTR names;
+	DWORD length;
+	DWORD capacity;
+public:
+	DWORD add(LPCWSTR name) {
+		DWORD nameLength = (DWORD)wcslen(name) + 1;
+		if (length + nameLength > capacity) {
+			DWORD newCapacity = capacity > 0 ? capacity : 4096;
+			while (newCapacity < length + nameLength) {
+				newCapacity *= 2;
+			}
+			names = resizeArray(names, length, newCapacity);
+			capacity = newCapacity;
 		}
+		DWORD offset = length;
+		memcpy(names + offset, name, nameLength * sizeof(wchar_t));
+		length += nameLength;
+		return offset;
 	}
 
-	void next(LPWSTR item, INT64& size) {
-		FileItem* f = (FileItem*)col->next();
-		wcscpy(item, f->name);
-		size = f->size;
+	LPCWSTR get(DWORD offset) {
+		return names + offset;
 	}
 
-	void item(int index, LPWSTR item, INT64& size) {
-		FileItem* f = (FileItem*)col->item(index);
-		wcscpy(item, f->name);
-		size = f->size;
+	/**
+	* Takes over all names of the other arena
+	* @return value to be added to the offsets of the other arena
+	*/
+	DWORD append(NameArena* other) {
+		DWORD base = length;
+		if (length + other->length > capacity) {
+			names = resizeArray(names, length, length + other->length);
+			capacity = length + other->length;
+		}
+		if (other->length > 0) {
+			memcpy(names + length, other->names, other->length * sizeof(wchar_t));
+		}
+		length += other->length;
+		other->clear();
+		return base;
 	}
 
-	int getSize() {
-		return col->getSize();
+	void clear() {
+		delete[] names;
+		names = NULL;
+		length = capacity = 0;
 	}
 
-	Files() {
-		col = new Collection();
+	size_t getMemoryUsage() {
+		return capacity * sizeof(wchar_t);
 	}
 
-	~Files() {
-		delete col;
+	NameArena() {
+		names = NULL;
+		length = capacity = 0;
 	}
-};
 
+	~NameArena() {
+		delete[] names;
+	}
+};
 
-class Duplicates {
+/**
+* Tree of all folders found, each folder only keeps its own name and the id
+* of its parent. Shared by all walkers, ids are assigned in the order found.
+*/
+class Folders {
 private:
-	class DuplicateItem {
+	DWORD* parents;
+	DWORD* names;
+	/** Serial number of the volume, set when the folder is parsed, 0 if not known */
+	DWORD* volumes;
+	int count;
+	int capacity;
+	NameArena arena;
+	/** Position of each folder in the folders sorted by path */
+	DWORD* ranks;
+	/** Number of folders when the ranks were built */
+	int rankedCount;
+	CRITICAL_SECTION lock;
+
+	class FolderKey {
 	public:
-		LPWSTR name1;
-		LPWSTR name2;
-		INT64 size;
-
-		DuplicateItem(LPCWSTR newName1, LPCWSTR newName2, INT64 newSize) {
-			name1 = new wchar_t[wcslen(newName1)+1];
-			wcscpy(name1, newName1);
-			name2 = new wchar_t[wcslen(newName2)+1];
-			wcscpy(name2, newName2);
-			size = newSize;
-		}
-
-		~DuplicateItem() {
-			delete name1;
-			delete name2;
-		}
+		LPWSTR path;
+		DWORD folder;
 	};
-	Collection* col;
-	INT64 byteSum;
-	int fileCount;
-public:
-	void add(LPCWSTR item1, LPCWSTR item2, INT64 size) {
-		DuplicateItem* d = new DuplicateItem(item1, item2, size);
-		col->push(d);
-		fileCount++;
-		byteSum += size;
-	}
 
-	bool pop(LPWSTR item1, LPWSTR item2, INT64& size) {
-		if (col->getSize() > 0) {
-			DuplicateItem* d = (DuplicateItem*)col->pop();
-			wcscpy(item1, d->name1);
-			wcscpy(item2, d->name2);
-			size = d->size;
-			delete d;
-			return true;
-		} else {
-			return false;
-		}
+	static int __cdecl compareKeys(const void* key1, const void* key2) {
+		return wcscmp(((FolderKey*)key1)->path, ((FolderKey*)key2)->path);
 	}
-
-	bool next(LPWSTR item1, LPWSTR item2, INT64& size) {
-		DuplicateItem* d = (DuplicateItem*)col->next();
-		if (d != NULL) {
-			wcscpy(item1, d->name1);
-			wcscpy(item2, d->name2);
-			size = d->size;
-			return true;
-		} else {
-			return false;
+public:
+	/**
+	* Adds a folder to the tree
+	* @param parent Id of the parent folder, NO_FOLDER for the paths to process
+	* @param name Name of the folder, full path for the paths to process
+	* @return id of the folder
+	*/
+	DWORD add(DWORD parent, LPCWSTR name) {
+		EnterCriticalSection(&lock);
+		if (count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 1024;
+			parents = resizeArray(parents, count, capacity);
+			names = resizeArray(names, count, capacity);
+			volumes = resizeArray(volumes, count, capacity);
 		}
+		DWORD folder = count++;
+		parents[folder] = parent;
+		names[folder] = arena.add(name);
+		volumes[folder] = 0;
+		LeaveCriticalSection(&lock);
+		return folder;
 	}
 
-	int getSize() {
-		return col->getSize();
+	/**
+	* Setter for the volume serial number of the folder, all files in it are on this volume
+	*/
+	void setVolume(DWORD folder, DWORD volume) {
+		// the arrays may be moved by another walker adding a folder
+		EnterCriticalSection(&lock);
+		volumes[folder] = volume;
+		LeaveCriticalSection(&lock);
 	}
 
-	int getFileCount() {
-		return fileCount;
+	DWORD getVolume(DWORD folder) {
+		return volumes[folder];
 	}
 
-	INT64 getByteSum() {
-		return byteSum;
+	DWORD getParent(DWORD folder) {
+		return parents[folder];
 	}
 
-	Duplicates() {
-		col = new Collection();
-		byteSum = 0;
-		fileCount = 0;
+	LPCWSTR getName(DWORD folder) {
+		return arena.get(names[folder]);
 	}
 
-	~Duplicates() {
-		delete col;
+	int getSize() {
+		return count;
 	}
-};
 
-/**
-* Duplicate File Linker Class
+	/**
+	* Length of the full path of the folder, without termination
+	*/
+	size_t getPathLength(DWORD folder) {
+		size_t length = wcslen(arena.get(names[folder]));
+		if (parents[folder] != NO_FOLDER) {
+			length += getPathLength(parents[folder]) + 1;
+		}
+		return length;
+	}
+
+	/**
+	* Writes the full path of the folder to the buffer, which must hold getPathLength() + 1 characters
+	* @return length of the path written
+	*/
+	size_t writePath(DWORD folder, LPWSTR buffer) {
+		size_t length = 0;
+		if (parents[folder] != NO_FOLDER) {
+			length = writePath(parents[folder], buffer);
+			buffer[length++] = L'\\';
+		}
+		LPCWSTR name = arena.get(names[folder]);
+		wcscpy(buffer + length, name);
+		return length + wcslen(name);
+	}
+
+	/**
+	* Builds the full path of the folder, also while walkers add folders
+	* @return path, to be deleted by the caller
+	*/
+	LPWSTR getPath(DWORD folder) {
+		EnterCriticalSection(&lock);
+		LPWSTR path = new wchar_t[getPathLength(folder) + 1];
+		writePath(folder, path);
+		LeaveCriticalSection(&lock);
+		return path;
+	}
+
+	/**
+	* Sorts the folders by their full path, files are ordered by folder rank
+	* and name, independent of the order the walkers found them
+	*/
+	void buildRanks() {
+		if (ranks != NULL && rankedCount == count) {
+			return;
+		}
+		rankedCount = count;
+		FolderKey* keys = new FolderKey[count > 0 ? count : 1];
+		for (int i = 0; i < count; i++) {
+			keys[i].path = new wchar_t[getPathLength(i) + 1];
+			writePath(i, keys[i].path);
+			keys[i].folder = i;
+		}
+		qsort(keys, count, sizeof(FolderKey), compareKeys);
+		delete[] ranks;
+		ranks = new DWORD[count > 0 ? count : 1];
+		for (int i = 0; i < count; i++) {
+			ranks[keys[i].folder] = i;
+			delete[] keys[i].path;
+		}
+		delete[] keys;
+	}
+
+	DWORD getRank(DWORD folder) {
+		return ranks[folder];
+	}
+
+	size_t getMemoryUsage() {
+		return capacity * 3 * sizeof(DWORD) + (ranks != NULL ? count * sizeof(DWORD) : 0) + arena.getMemoryUsage();
+	}
+
+	Folders() {
+		parents = names = volumes = ranks = NULL;
+		count = capacity = rankedCount = 0;
+		InitializeCriticalSection(&lock);
+	}
+
+	~Folders() {
+		DeleteCriticalSection(&lock);
+		delete[] parents;
+		delete[] names;
+		delete[] volumes;
+		delete[] ranks;
+	}
+};
+
+/**
+* Open handles of the folders recently used by one thread. A folder is
+* opened relative to the handle of its parent, so each part of a path is
+* only looked up once.
+*/
+class FolderCache {
+private:
+	Folders* folders;
+	DWORD* ids;
+	HANDLE* handles;
+	/** Group each handle was last requested for, handles of the current group are kept */
+	DWORD* uses;
+	int count;
+	int capacity;
+	/** Next slot to be replaced */
+	int next;
+	DWORD group;
+
+	/**
+	* Finds a slot for a new handle, growing the cache if all handles are used by the current group
+	*/
+	int getFreeSlot() {
+		if (count < capacity) {
+			return count++;
+		}
+		for (int i = 0; i < capacity; i++) {
+			int slot = (next + i) % capacity;
+			if (uses[slot] != group) {
+				next = (slot + 1) % capacity;
+				if (handles[slot] != INVALID_HANDLE_VALUE) {
+					CloseHandle(handles[slot]);
+				}
+				return slot;
+			}
+		}
+		ids = resizeArray(ids, count, capacity * 2);
+		handles = resizeArray(handles, count, capacity * 2);
+		uses = resizeArray(uses, count, capacity * 2);
+		capacity *= 2;
+		return count++;
+	}
+
+	HANDLE get(DWORD folder, bool keep) {
+		for (int i = 0; i < count; i++) {
+			if (ids[i] == folder) {
+				if (keep) {
+					uses[i] = group;
+				}
+				return handles[i];
+			}
+		}
+
+		HANDLE hFolder;
+		DWORD parent = folders->getParent(folder);
+		if (parent == NO_FOLDER) {
+			LPWSTR path = folders->getPath(folder);
+			hFolder = CreateFile(path, FILE_TRAVERSE | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+			delete[] path;
+		} else {
+			// the parent is only needed until the folder is open
+			HANDLE hParent = get(parent, false);
+			hFolder = hParent == INVALID_HANDLE_VALUE ? INVALID_HANDLE_VALUE :
+				openRelative(hParent, folders->getName(folder), FILE_TRAVERSE | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+					NT_FILE_DIRECTORY_FILE | NT_FILE_SYNCHRONOUS_IO_NONALERT | NT_FILE_OPEN_FOR_BACKUP_INTENT);
+		}
+		int slot = getFreeSlot();
+		ids[slot] = folder;
+		handles[slot] = hFolder;
+		uses[slot] = keep ? group : 0;
+		return hFolder;
+	}
+public:
+	FolderCache(Folders* newFolders) {
+		folders = newFolders;
+		capacity = FOLDER_CACHE_SIZE;
+		ids = new DWORD[capacity];
+		handles = new HANDLE[capacity];
+		uses = new DWORD[capacity];
+		count = next = 0;
+		group = 0;
+	}
+
+	~FolderCache() {
+		for (int i = 0; i < count; i++) {
+			if (handles[i] != INVALID_HANDLE_VALUE) {
+				CloseHandle(handles[i]);
+			}
+		}
+		delete[] ids;
+		delete[] handles;
+		delete[] uses;
+	}
+
+	/**
+	* Starts a new group, the handles requested for it stay open until the next group
+	*/
+	void startGroup() {
+		group++;
+	}
+
+	/**
+	* Handle of the folder, opened relative to its parent on first use
+	* @return handle, INVALID_HANDLE_VALUE if the folder can't be opened
+	*/
+	HANDLE get(DWORD folder) {
+		return get(folder, true);
+	}
+};
+
+/**
+* Record of a file in a run file, followed by the characters of the name
+*/
+class RunHeader {
+public:
+	INT64 size;
+	INT64 lastWrite;
+	INT64 fileId;
+	DWORD parent;
+	WORD nameLength;
+};
+
+/**
+* Buffered writer of run records
+*/
+class RunWriter {
+private:
+	HANDLE hFile;
+	LPBYTE buffer;
+	DWORD length;
+	bool success;
+public:
+	RunWriter(HANDLE newFile) {
+		hFile = newFile;
+		buffer = new BYTE[RUN_BUFFER_SIZE];
+		length = 0;
+		success = true;
+	}
+
+	~RunWriter() {
+		delete[] buffer;
+	}
+
+	void write(const RunHeader& header, LPCWSTR name) {
+		DWORD nameBytes = header.nameLength * sizeof(wchar_t);
+		if (length + sizeof(header) + nameBytes > RUN_BUFFER_SIZE) {
+			flush();
+		}
+		memcpy(buffer + length, &header, sizeof(header));
+		memcpy(buffer + length + sizeof(header), name, nameBytes);
+		length += sizeof(header) + nameBytes;
+	}
+
+	/**
+	* Writes the records buffered
+	* @return boolean value if all records so far were written
+	*/
+	bool flush() {
+		DWORD written;
+		if (success && length > 0) {
+			success = WriteFile(hFile, buffer, length, &written, NULL) && written == length;
+		}
+		length = 0;
+		return success;
+	}
+};
+
+/**
+* Table of files, kept as parallel arrays. Names are stored in an arena and
+* the paths as ids into the folder tree, full paths are only built when needed.
+*/
+class Files {
+private:
+	Folders* folders;
+	INT64* sizes;
+	INT64* lastWrites;
+	/** File index on the volume of the parent folder, 0 if not known */
+	INT64* fileIds;
+	DWORD* parents;
+	DWORD* names;
+	/** Next name of the same file after building the size index, -1 at the end of the chain */
+	int* nextAliases;
+	int count;
+	int capacity;
+	NameArena* arena;
+	/** Offsets of the size groups after building the size index, with an additional end marker */
+	int* groupStart;
+	int groupCount;
+	/** Sum of bytes of all files in the size groups */
+	INT64 groupBytes;
+	/** Number of names found to be hard links of another name */
+	int aliasCount;
+
+	class SortKey {
+	public:
+		INT64 size;
+		INT64 fileId;
+		DWORD volume;
+		DWORD rank;
+		LPCWSTR name;
+		int file;
+		/** First name of the same file if this is a hard link of it, -1 otherwise */
+		int alias;
+	};
+
+	/**
+	* Sort helper bringing the names of each file together, ordered by path
+	*/
+	static int __cdecl compareIdentities(const void* key1, const void* key2) {
+		SortKey* k1 = (SortKey*)key1;
+		SortKey* k2 = (SortKey*)key2;
+		if (k1->size != k2->size) {
+			return k1->size < k2->size ? -1 : 1;
+		}
+		if (k1->volume != k2->volume) {
+			return k1->volume < k2->volume ? -1 : 1;
+		}
+		if (k1->fileId != k2->fileId) {
+			return k1->fileId < k2->fileId ? -1 : 1;
+		}
+		return comparePaths(k1, k2);
+	}
+
+	/**
+	* Sort helper for the size index, first names of the files are ordered
+	* by size and path, followed by all hard links in the same order
+	*/
+	static int __cdecl compareKeys(const void* key1, const void* key2) {
+		SortKey* k1 = (SortKey*)key1;
+		SortKey* k2 = (SortKey*)key2;
+		if ((k1->alias < 0) != (k2->alias < 0)) {
+			return k1->alias < 0 ? -1 : 1;
+		}
+		if (k1->size != k2->size) {
+			return k1->size < k2->size ? -1 : 1;
+		}
+		return comparePaths(k1, k2);
+	}
+
+	class RunKey {
+	public:
+		INT64 size;
+		int file;
+	};
+
+	static int __cdecl compareRunKeys(const void* key1, const void* key2) {
+		INT64 size1 = ((RunKey*)key1)->size;
+		INT64 size2 = ((RunKey*)key2)->size;
+		return size1 < size2 ? -1 : (size1 > size2 ? 1 : 0);
+	}
+
+	static int comparePaths(SortKey* k1, SortKey* k2) {
+		if (k1->rank != k2->rank) {
+			return k1->rank < k2->rank ? -1 : 1;
+		}
+		return wcscmp(k1->name, k2->name);
+	}
+
+	void reserve(int needed) {
+		if (count + needed > capacity) {
+			int newCapacity = capacity > 0 ? capacity : 1024;
+			while (newCapacity < count + needed) {
+				newCapacity *= 2;
+			}
+			sizes = resizeArray(sizes, count, newCapacity);
+			lastWrites = resizeArray(lastWrites, count, newCapacity);
+			fileIds = resizeArray(fileIds, count, newCapacity);
+			parents = resizeArray(parents, count, newCapacity);
+			names = resizeArray(names, count, newCapacity);
+			capacity = newCapacity;
+		}
+	}
+
+	void clear() {
+		delete[] sizes;
+		delete[] lastWrites;
+		delete[] fileIds;
+		delete[] parents;
+		delete[] names;
+		delete[] nextAliases;
+		delete[] groupStart;
+		sizes = lastWrites = fileIds = NULL;
+		parents = names = NULL;
+		nextAliases = groupStart = NULL;
+		count = capacity = groupCount = aliasCount = 0;
+		groupBytes = 0;
+		arena->clear();
+	}
+
+	/**
+	* Copies a file to the position n of the new table
+	*/
+	void copyFile(int file, int n, INT64* newSizes, INT64* newLastWrites, INT64* newFileIds, DWORD* newParents, DWORD* newNames, NameArena* newArena) {
+		newSizes[n] = sizes[file];
+		newLastWrites[n] = lastWrites[file];
+		newFileIds[n] = fileIds[file];
+		newParents[n] = parents[file];
+		newNames[n] = newArena->add(arena->get(names[file]));
+	}
+public:
+	/**
+	* Adds a file to the table
+	* @param parent Id of the folder containing the file
+	* @param name Name of the file without path
+	* @param fileId File index on the volume, 0 if not known
+	*/
+	void add(DWORD parent, LPCWSTR name, INT64 size, INT64 lastWrite, INT64 fileId) {
+		reserve(1);
+		sizes[count] = size;
+		lastWrites[count] = lastWrite;
+		fileIds[count] = fileId;
+		parents[count] = parent;
+		names[count] = arena->add(name);
+		count++;
+	}
+
+	int getSize() {
+		return count;
+	}
+
+	/**
+	* Takes over all files collected by the other table
+	*/
+	void merge(Files* other) {
+		reserve(other->count);
+		DWORD base = arena->append(other->arena);
+		memcpy(sizes + count, other->sizes, other->count * sizeof(INT64));
+		memcpy(lastWrites + count, other->lastWrites, other->count * sizeof(INT64));
+		memcpy(fileIds + count, other->fileIds, other->count * sizeof(INT64));
+		memcpy(parents + count, other->parents, other->count * sizeof(DWORD));
+		for (int i = 0; i < other->count; i++) {
+			names[count + i] = other->names[i] + base;
+		}
+		count += other->count;
+		other->clear();
+	}
+
+	/**
+	* Writes all files sorted by size to a run file and empties the table
+	* @return boolean value if all records were written
+	*/
+	bool writeRun(HANDLE hFile) {
+		RunKey* keys = new RunKey[count > 0 ? count : 1];
+		for (int i = 0; i < count; i++) {
+			keys[i].size = sizes[i];
+			keys[i].file = i;
+		}
+		qsort(keys, count, sizeof(RunKey), compareRunKeys);
+
+		RunWriter writer(hFile);
+		for (int i = 0; i < count; i++) {
+			int file = keys[i].file;
+			LPCWSTR name = arena->get(names[file]);
+			RunHeader header;
+			header.size = sizes[file];
+			header.lastWrite = lastWrites[file];
+			header.fileId = fileIds[file];
+			header.parent = parents[file];
+			header.nameLength = (WORD)wcslen(name);
+			writer.write(header, name);
+		}
+		delete[] keys;
+		clear();
+		return writer.flush();
+	}
+
+	/**
+	* Sorts the table by size and path. Names sharing the file id on a volume
+	* are hard links of one file, they collapse into this file before grouping.
+	* Sizes with less than two files can't have a duplicate and are dropped right
+	* away. The first names of the files of each size group follow each other
+	* afterwards, the other names are chained behind the end of the groups.
+	* @return number of size groups with at least two files
+	*/
+	int buildSizeIndex() {
+		folders->buildRanks();
+		SortKey* keys = new SortKey[count > 0 ? count : 1];
+		for (int i = 0; i < count; i++) {
+			keys[i].size = sizes[i];
+			keys[i].fileId = fileIds[i];
+			keys[i].volume = folders->getVolume(parents[i]);
+			keys[i].rank = folders->getRank(parents[i]);
+			keys[i].name = arena->get(names[i]);
+			keys[i].file = i;
+			keys[i].alias = -1;
+		}
+
+		// collapse the names of each file
+		qsort(keys, count, sizeof(SortKey), compareIdentities);
+		aliasCount = 0;
+		for (int i = 1; i < count; i++) {
+			SortKey& previous = keys[i - 1];
+			// 0 and -1 (FILE_INVALID_FILE_ID) are no ids, neither is any id on an unknown volume
+			bool known = keys[i].fileId != 0 && keys[i].fileId != -1 && keys[i].volume != 0;
+			if (known && keys[i].fileId == previous.fileId && keys[i].volume == previous.volume && keys[i].size == previous.size) {
+				keys[i].alias = previous.alias >= 0 ? previous.alias : previous.file;
+				aliasCount++;
+			}
+		}
+		qsort(keys, count, sizeof(SortKey), compareKeys);
+		int files = count - aliasCount;
+
+		// number the files in runs of equal size
+		int* newIndex = new int[count > 0 ? count : 1];
+		for (int i = 0; i < count; i++) {
+			newIndex[i] = -1;
+		}
+		int kept = 0;
+		for (int runStart = 0, runEnd; runStart < files; runStart = runEnd) {
+			for (runEnd = runStart + 1; runEnd < files && keys[runEnd].size == keys[runStart].size; runEnd++);
+			if (runEnd - runStart > 1) {
+				for (int i = runStart; i < runEnd; i++) {
+					newIndex[keys[i].file] = kept++;
+				}
+			}
+		}
+		int keptAliases = 0;
+		for (int i = files; i < count; i++) {
+			if (newIndex[keys[i].alias] >= 0) {
+				keptAliases++;
+			}
+		}
+
+		// copy these runs to the new table, followed by the other names of their files
+		int total = kept + keptAliases;
+		INT64* keptSizes = new INT64[total > 0 ? total : 1];
+		INT64* keptLastWrites = new INT64[total > 0 ? total : 1];
+		INT64* keptFileIds = new INT64[total > 0 ? total : 1];
+		DWORD* keptParents = new DWORD[total > 0 ? total : 1];
+		DWORD* keptNames = new DWORD[total > 0 ? total : 1];
+		int* keptNextAliases = new int[total > 0 ? total : 1];
+		NameArena* keptArena = new NameArena();
+		delete[] groupStart;
+		groupStart = new int[kept / 2 + 1];
+		groupCount = 0;
+		groupBytes = 0;
+		int n = 0;
+		for (int runStart = 0, runEnd; runStart < files; runStart = runEnd) {
+			for (runEnd = runStart + 1; runEnd < files && keys[runEnd].size == keys[runStart].size; runEnd++);
+			if (runEnd - runStart > 1) {
+				groupStart[groupCount++] = n;
+				for (int i = runStart; i < runEnd; i++) {
+					copyFile(keys[i].file, n, keptSizes, keptLastWrites, keptFileIds, keptParents, keptNames, keptArena);
+					keptNextAliases[n] = -1;
+					n++;
+				}
+				groupBytes += keys[runStart].size * (runEnd - runStart);
+			}
+		}
+		groupStart[groupCount] = n;
+		n = total;
+		for (int i = count - 1; i >= files; i--) {
+			int first = newIndex[keys[i].alias];
+			if (first >= 0) {
+				// walking backwards, so each name goes in front of the chain
+				n--;
+				copyFile(keys[i].file, n, keptSizes, keptLastWrites, keptFileIds, keptParents, keptNames, keptArena);
+				keptNextAliases[n] = keptNextAliases[first];
+				keptNextAliases[first] = n;
+			}
+		}
+		delete[] newIndex;
+		delete[] keys;
+
+		delete[] sizes;
+		delete[] lastWrites;
+		delete[] fileIds;
+		delete[] parents;
+		delete[] names;
+		delete[] nextAliases;
+		delete arena;
+		sizes = keptSizes;
+		lastWrites = keptLastWrites;
+		fileIds = keptFileIds;
+		parents = keptParents;
+		names = keptNames;
+		nextAliases = keptNextAliases;
+		arena = keptArena;
+		count = capacity = total;
+		return groupCount;
+	}
+
+	int getGroupCount() {
+		return groupCount;
+	}
+
+	int getGroupMemberCount(int group) {
+		return groupStart[group + 1] - groupStart[group];
+	}
+
+	INT64 getGroupFileSize(int group) {
+		return sizes[groupStart[group]];
+	}
+
+	/**
+	* @return id of the file, valid until the table changes
+	*/
+	int getGroupMember(int group, int member) {
+		return groupStart[group] + member;
+	}
+
+	INT64 getGroupBytes() {
+		return groupBytes;
+	}
+
+	/**
+	* Getter for the number of names collapsed into the file they are a hard link of
+	*/
+	int getAliasCount() {
+		return aliasCount;
+	}
+
+	/**
+	* @return id of the next name of the same file, -1 if there is none
+	*/
+	int getNextAlias(int file) {
+		return nextAliases[file];
+	}
+
+	/**
+	* Number of names of the file found in the tree, a lower bound of its link count
+	*/
+	int getLinkCount(int file) {
+		int links = 1;
+		for (int alias = nextAliases[file]; alias >= 0; alias = nextAliases[alias]) {
+			links++;
+		}
+		return links;
+	}
+
+	INT64 getLastWrite(int file) {
+		return lastWrites[file];
+	}
+
+	DWORD getParent(int file) {
+		return parents[file];
+	}
+
+	/**
+	* Builds the full path of the file
+	* @return path, to be deleted by the caller
+	*/
+	LPWSTR getPath(int file) {
+		LPCWSTR name = arena->get(names[file]);
+		LPWSTR path = new wchar_t[folders->getPathLength(parents[file]) + wcslen(name) + 2];
+		size_t length = folders->writePath(parents[file], path);
+		path[length++] = L'\\';
+		wcscpy(path + length, name);
+		return path;
+	}
+
+	/**
+	* Bytes the full paths of all files would take as separate strings
+	*/
+	INT64 getPathBytes() {
+		INT64 bytes = 0;
+		for (int i = 0; i < count; i++) {
+			bytes += (folders->getPathLength(parents[i]) + wcslen(arena->get(names[i])) + 2) * sizeof(wchar_t);
+		}
+		return bytes;
+	}
+
+	size_t getMemoryUsage() {
+		return capacity * (3 * sizeof(INT64) + 2 * sizeof(DWORD)) + arena->getMemoryUsage()
+			+ (nextAliases != NULL ? count * sizeof(int) : 0)
+			+ (groupStart != NULL ? (groupCount + 1) * sizeof(int) : 0);
+	}
+
+	Files(Folders* newFolders = NULL) {
+		folders = newFolders;
+		sizes = lastWrites = fileIds = NULL;
+		parents = names = NULL;
+		nextAliases = groupStart = NULL;
+		count = capacity = groupCount = aliasCount = 0;
+		groupBytes = 0;
+		arena = new NameArena();
+	}
+
+	~Files() {
+		clear();
+		delete arena;
+	}
+};
+
+/**
+* Sorted runs of file records, spilled to temporary files when the file
+* table would exceed the memory limit. The runs are merged by size and read
+* back in chunks of whole size groups, sizes with one file are dropped.
+*/
+class FileRuns {
+private:
+	class Run {
+	public:
+		HANDLE hFile;
+		LPBYTE buffer;
+		/** Bytes in the buffer and bytes of it consumed */
+		DWORD length;
+		DWORD position;
+		/** Current record of the merge */
+		RunHeader header;
+		wchar_t name[MAX_PATH];
+	};
+	Run** runs;
+	int runCount;
+	int runCapacity;
+	/** Runs not exhausted yet, as heap on the size of their current record */
+	Run** heap;
+	int heapCount;
+	/** Bytes read from a run at once */
+	DWORD readSize;
+	size_t memoryLimit;
+	int tables;
+	INT64 recordCount;
+	CRITICAL_SECTION lock;
+
+	bool read(Run* run, void* data, DWORD bytes) {
+		LPBYTE target = (LPBYTE)data;
+		while (bytes > 0) {
+			if (run->position == run->length) {
+				if (!ReadFile(run->hFile, run->buffer, readSize, &run->length, NULL) || run->length == 0) {
+					return false;
+				}
+				run->position = 0;
+			}
+			DWORD chunk = run->length - run->position < bytes ? run->length - run->position : bytes;
+			memcpy(target, run->buffer + run->position, chunk);
+			run->position += chunk;
+			target += chunk;
+			bytes -= chunk;
+		}
+		return true;
+	}
+
+	/**
+	* Reads the next record of the run
+	* @return boolean value if there was one
+	*/
+	bool next(Run* run) {
+		if (!read(run, &run->header, sizeof(RunHeader))) {
+			return false;
+		}
+		if (run->header.nameLength >= MAX_PATH || !read(run, run->name, run->header.nameLength * sizeof(wchar_t))) {
+			throw L"Run file of the file table is damaged";
+		}
+		run->name[run->header.nameLength] = 0;
+		return true;
+	}
+
+	void siftDown(int i) {
+		while (true) {
+			int smallest = i;
+			for (int child = 2 * i + 1; child <= 2 * i + 2 && child < heapCount; child++) {
+				if (heap[child]->header.size < heap[smallest]->header.size) {
+					smallest = child;
+				}
+			}
+			if (smallest == i) {
+				return;
+			}
+			Run* swap = heap[i];
+			heap[i] = heap[smallest];
+			heap[smallest] = swap;
+			i = smallest;
+		}
+	}
+
+	/**
+	* Moves the run with the smallest record to its next record
+	*/
+	void advance() {
+		if (!next(heap[0])) {
+			heap[0] = heap[--heapCount];
+		}
+		siftDown(0);
+	}
+
+	/**
+	* Creates a new run file, can be called by several threads at once
+	* @return handle of the file, INVALID_HANDLE_VALUE on errors
+	*/
+	HANDLE createRun(int recordsToWrite) {
+		EnterCriticalSection(&lock);
+		if (runCount == runCapacity) {
+			runCapacity = runCapacity > 0 ? runCapacity * 2 : 64;
+			runs = resizeArray(runs, runCount, runCapacity);
+		}
+		int number = runCount++;
+		runs[number] = NULL;
+		recordCount += recordsToWrite;
+		LeaveCriticalSection(&lock);
+
+		wchar_t folder[MAX_PATH];
+		wchar_t name[MAX_PATH + 32];
+		GetTempPath(MAX_PATH, folder);
+		wsprintf(name, L"%sDFHL.%u.%i.run", folder, GetCurrentProcessId(), number);
+		HANDLE hFile = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return hFile;
+		}
+		logDebug(L"Writing %i records to run %s", recordsToWrite, name);
+		Run* run = new Run();
+		run->hFile = hFile;
+		run->buffer = NULL;
+		EnterCriticalSection(&lock);
+		runs[number] = run;
+		LeaveCriticalSection(&lock);
+		return hFile;
+	}
+
+	/**
+	* Starts to merge the given runs, the read buffers of all take an eighth of the limit
+	*/
+	void openRuns(int first, int count) {
+		readSize = (DWORD)(memoryLimit / 8 / (count > 0 ? count : 1) / 4096 * 4096);
+		if (readSize < 4096) {
+			readSize = 4096;
+		} else if (readSize > RUN_BUFFER_SIZE) {
+			readSize = RUN_BUFFER_SIZE;
+		}
+		delete[] heap;
+		heap = new Run*[count > 0 ? count : 1];
+		heapCount = 0;
+		for (int i = first; i < first + count; i++) {
+			Run* run = runs[i];
+			if (run == NULL) {
+				continue;
+			}
+			LARGE_INTEGER start;
+			start.QuadPart = 0;
+			SetFilePointerEx(run->hFile, start, NULL, FILE_BEGIN);
+			run->buffer = new BYTE[readSize];
+			run->length = run->position = 0;
+			if (next(run)) {
+				heap[heapCount++] = run;
+			}
+		}
+		for (int i = heapCount / 2 - 1; i >= 0; i--) {
+			siftDown(i);
+		}
+	}
+
+	/**
+	* Closes and deletes the given runs
+	*/
+	void closeRuns(int first, int count) {
+		for (int i = first; i < first + count; i++) {
+			if (runs[i] != NULL) {
+				CloseHandle(runs[i]->hFile);
+				delete[] runs[i]->buffer;
+				delete runs[i];
+				runs[i] = NULL;
+			}
+		}
+	}
+public:
+	/**
+	* @param newMemoryLimit Bytes the file tables may take altogether
+	* @param newTables Number of tables filled in parallel, each gets its share
+	*/
+	FileRuns(size_t newMemoryLimit, int newTables) {
+		memoryLimit = newMemoryLimit;
+		tables = newTables;
+		runs = heap = NULL;
+		runCount = runCapacity = heapCount = 0;
+		readSize = RUN_BUFFER_SIZE;
+		recordCount = 0;
+		InitializeCriticalSection(&lock);
+	}
+
+	~FileRuns() {
+		// the runs are deleted on close
+		closeRuns(0, runCount);
+		delete[] runs;
+		delete[] heap;
+		DeleteCriticalSection(&lock);
+	}
+
+	/**
+	* Size a table filled in parallel may grow to before it's written to a run
+	*/
+	size_t getTableLimit() {
+		return memoryLimit / 4 / tables;
+	}
+
+	int getRunCount() {
+		return runCount;
+	}
+
+	INT64 getRecordCount() {
+		return recordCount;
+	}
+
+	/**
+	* Writes the files of the table to a new run and empties the table, can be
+	* called by several threads at once
+	* @return boolean value if the run was written, the error is given by GetLastError()
+	*/
+	bool write(Files* files) {
+		if (files->getSize() == 0) {
+			return true;
+		}
+		HANDLE hFile = createRun(files->getSize());
+		return hFile != INVALID_HANDLE_VALUE && files->writeRun(hFile);
+	}
+
+	/**
+	* Starts to merge the runs, no more runs may be written. As long as the
+	* read buffers of all runs would get too small, the oldest runs are merged
+	* into larger ones first.
+	*/
+	void startMerge() {
+		int fanIn = (int)(memoryLimit / 8 / 65536);
+		if (fanIn < 2) {
+			fanIn = 2;
+		}
+		int first = 0;
+		while (runCount - first > fanIn) {
+			openRuns(first, fanIn);
+			HANDLE hFile = createRun(0);
+			if (hFile == INVALID_HANDLE_VALUE) {
+				throw L"Unable to create run file";
+			}
+			RunWriter writer(hFile);
+			while (heapCount > 0) {
+				writer.write(heap[0]->header, heap[0]->name);
+				advance();
+			}
+			if (!writer.flush()) {
+				throw L"Unable to write run file";
+			}
+			closeRuns(first, fanIn);
+			first += fanIn;
+		}
+		logVerbose(L"Merging %i runs", runCount - first);
+		openRuns(first, runCount - first);
+	}
+
+	/**
+	* Reads the next size groups into the table, until it reaches its share
+	* of the limit. A size group is never split.
+	* @return boolean value if any files were read
+	*/
+	bool readGroups(Files* files) {
+		RunHeader first;
+		wchar_t firstName[MAX_PATH];
+		while (heapCount > 0 && files->getMemoryUsage() < memoryLimit / 4) {
+			INT64 size = heap[0]->header.size;
+			int n = 0;
+			while (heapCount > 0 && heap[0]->header.size == size) {
+				Run* run = heap[0];
+				// the first file is only added if a second one follows
+				if (n == 0) {
+					first = run->header;
+					wcscpy(firstName, run->name);
+				} else {
+					if (n == 1) {
+						files->add(first.parent, firstName, first.size, first.lastWrite, first.fileId);
+					}
+					files->add(run->header.parent, run->name, run->header.size, run->header.lastWrite, run->header.fileId);
+				}
+				n++;
+				advance();
+			}
+		}
+		return files->getSize() > 0;
+	}
+};
+
+/**
+* Content hash of a file as given in the results
+*/
+class ContentDigest {
+public:
+	/** Hash the digest was calculated with, NO_HASH if the file was not hashed */
+	HashMethod method;
+	/** Digest, the MurmurHash3 uses the first HASH_DIGEST_SIZE bytes */
+	BYTE bytes[BLAKE3_DIGEST_SIZE];
+};
+
+class Duplicates {
+public:
+	/**
+	* Set of equal files, all names are linked to the first one
+	*/
+	class Group {
+	public:
+		LPWSTR* names;
+		int count;
+		/** Number of files (not names) replaced by the first one */
+		int files;
+		INT64 size;
+		/** Content hash of the files, if they were compared by it */
+		ContentDigest digest;
+
+		Group(LPCWSTR* newNames, int newCount, int newFiles, INT64 newSize, const ContentDigest* newDigest) {
+			names = new LPWSTR[newCount];
+			for (int i = 0; i < newCount; i++) {
+				names[i] = new wchar_t[wcslen(newNames[i])+1];
+				wcscpy(names[i], newNames[i]);
+			}
+			count = newCount;
+			files = newFiles;
+			size = newSize;
+			if (newDigest != NULL) {
+				digest = *newDigest;
+			} else {
+				digest.method = NO_HASH;
+			}
+		}
+
+		~Group() {
+			for (int i = 0; i < count; i++) {
+				delete[] names[i];
+			}
+			delete[] names;
+		}
+	};
+private:
+	Collection* col;
+	INT64 byteSum;
+	int fileCount;
+public:
+	/**
+	* Adds a set of equal files
+	* @param names Names of the files, the first one is the target all others are linked to
+	* @param count Number of names
+	* @param files Number of files replaced by the target, several names may belong to one file
+	* @param digest Content hash of the files, NULL if not known
+	*/
+	void add(LPCWSTR* names, int count, int files, INT64 size, const ContentDigest* digest = NULL) {
+		Group* g = new Group(names, count, files, size, digest);
+		col->push(g);
+		fileCount += files;
+		byteSum += size * files;
+	}
+
+	/**
+	* Removes the first group, to be deleted by the caller
+	*/
+	Group* pop() {
+		return (Group*)col->pop();
+	}
+
+	Group* next() {
+		return (Group*)col->next();
+	}
+
+	int getSize() {
+		return col->getSize();
+	}
+
+	int getFileCount() {
+		return fileCount;
+	}
+
+	/**
+	* Takes over all duplicates collected by the other collection
+	*/
+	void merge(Duplicates* other) {
+		col->appendAll(other->col);
+		fileCount += other->fileCount;
+		byteSum += other->byteSum;
+		other->fileCount = 0;
+		other->byteSum = 0;
+	}
+
+	INT64 getByteSum() {
+		return byteSum;
+	}
+
+	Duplicates() {
+		col = new Collection();
+		byteSum = 0;
+		fileCount = 0;
+	}
+
+	~Duplicates() {
+		while (col->getSize() > 0) {
+			delete (Group*)col->pop();
+		}
+		delete col;
+	}
+};
+
+/**
+* Streaming calculation of the full content hash (128 bit MurmurHash3)
+*/
+class ContentHash {
+private:
+	UINT64 h1;
+	UINT64 h2;
+	UINT64 length;
+	/** bytes left over from the last update, always less than one 16 byte block */
+	BYTE tail[16];
+	DWORD tailLength;
+
+	static inline UINT64 rotl(UINT64 x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static inline UINT64 mix(UINT64 k) {
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+
+	inline void block(const BYTE* data) {
+		UINT64 k1 = *(const UINT64*)data;
+		UINT64 k2 = *(const UINT64*)(data + 8);
+		k1 *= 0x87c37b91114253d5ULL; k1 = rotl(k1, 31); k1 *= 0x4cf5ad432745937fULL; h1 ^= k1;
+		h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= 0x4cf5ad432745937fULL; k2 = rotl(k2, 33); k2 *= 0x87c37b91114253d5ULL; h2 ^= k2;
+		h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+public:
+	ContentHash() {
+		reset();
+	}
+
+	void reset() {
+		h1 = h2 = 0;
+		length = 0;
+		tailLength = 0;
+	}
+
+	void update(const BYTE* data, size_t size) {
+		length += size;
+		if (tailLength > 0) {
+			while (tailLength < 16 && size > 0) {
+				tail[tailLength++] = *data++;
+				size--;
+			}
+			if (tailLength < 16) {
+				return;
+			}
+			block(tail);
+			tailLength = 0;
+		}
+		for (; size >= 16; size -= 16, data += 16) {
+			block(data);
+		}
+		while (size > 0) {
+			tail[tailLength++] = *data++;
+			size--;
+		}
+	}
+
+	void finish(BYTE digest[HASH_DIGEST_SIZE]) {
+		UINT64 k1 = 0;
+		UINT64 k2 = 0;
+		for (int i = (int)tailLength - 1; i >= 8; i--) {
+			k2 = (k2 << 8) | tail[i];
+		}
+		for (int i = (tailLength < 8 ? (int)tailLength : 8) - 1; i >= 0; i--) {
+			k1 = (k1 << 8) | tail[i];
+		}
+		if (tailLength > 8) {
+			k2 *= 0x4cf5ad432745937fULL; k2 = rotl(k2, 33); k2 *= 0x87c37b91114253d5ULL; h2 ^= k2;
+		}
+		if (tailLength > 0) {
+			k1 *= 0x87c37b91114253d5ULL; k1 = rotl(k1, 31); k1 *= 0x4cf5ad432745937fULL; h1 ^= k1;
+		}
+		h1 ^= length;
+		h2 ^= length;
+		h1 += h2;
+		h2 += h1;
+		h1 = mix(h1);
+		h2 = mix(h2);
+		h1 += h2;
+		h2 += h1;
+		memcpy(digest, &h1, 8);
+		memcpy(digest + 8, &h2, 8);
+	}
+};
+
+/**
+* Threads started once that take on parts of the work of other threads. The
+* thread handing out the parts works on them as well, parts no helper is free
+* for are done by itself, so it never waits for a busy helper to start.
+*/
+class HelperThreads {
+private:
+	/**
+	* One part of the work handed out by run
+	*/
+	class Task {
+	public:
+		ThreadProc proc;
+		void* param;
+		/** Parts of the same run not done yet */
+		volatile LONG* remaining;
+		/** Set when the last part of the run is done */
+		HANDLE done;
+		Task* next;
+	};
+
+	CRITICAL_SECTION lock;
+	/** Released once for each part queued and for each thread to stop */
+	HANDLE available;
+	HANDLE* threads;
+	int threadCount;
+	/** Queued parts of all runs, oldest first */
+	Task* first;
+	Task* last;
+	volatile bool stopping;
+
+	Task* pop() {
+		EnterCriticalSection(&lock);
+		Task* task = first;
+		if (task != NULL) {
+			first = task->next;
+			if (first == NULL) {
+				last = NULL;
+			}
+		}
+		LeaveCriticalSection(&lock);
+		return task;
+	}
+
+	static void execute(Task* task) {
+		// the run may return as soon as its last part is counted
+		HANDLE done = task->done;
+		task->proc(task->param);
+		if (InterlockedDecrement(task->remaining) == 0) {
+			SetEvent(done);
+		}
+	}
+
+	static unsigned __stdcall helperThread(void* param) {
+		HelperThreads* h = (HelperThreads*)param;
+		while (true) {
+			WaitForSingleObject(h->available, INFINITE);
+			if (h->stopping) {
+				return 0;
+			}
+			// the part may already have been taken by the thread handing it out
+			Task* task = h->pop();
+			if (task != NULL) {
+				execute(task);
+			}
+		}
+	}
+
+public:
+	/**
+	* Starts the helper threads, none for a count of zero
+	*/
+	HelperThreads(int count) {
+		InitializeCriticalSection(&lock);
+		available = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+		threads = new HANDLE[count > 0 ? count : 1];
+		threadCount = 0;
+		first = last = NULL;
+		stopping = false;
+		for (int i = 0; i < count && available != NULL; i++) {
+			HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, helperThread, this, 0, NULL);
+			if (thread == 0) {
+				logError(GetLastError(), L"Unable to start helper thread.");
+				break;
+			}
+			threads[threadCount++] = thread;
+		}
+	}
+
+	~HelperThreads() {
+		stopping = true;
+		if (threadCount > 0) {
+			ReleaseSemaphore(available, threadCount, NULL);
+		}
+		for (int i = 0; i < threadCount; i++) {
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+		delete[] threads;
+		if (available != NULL) {
+			CloseHandle(available);
+		}
+		DeleteCriticalSection(&lock);
+	}
+
+	int getThreadCount() {
+		return threadCount;
+	}
+
+	/**
+	* Runs the thread procedure once for each of the parameters and waits until
+	* all are done. The calling thread takes the first one and every one no
+	* helper started yet, the others are run by the helpers.
+	*/
+	void run(ThreadProc proc, void** params, int count) {
+		HANDLE done = count > 1 && threadCount > 0 ? CreateEvent(NULL, TRUE, FALSE, NULL) : NULL;
+		if (done == NULL) {
+			for (int i = 0; i < count; i++) {
+				proc(params[i]);
+			}
+			return;
+		}
+		volatile LONG remaining = count;
+		Task* tasks = new Task[count];
+		for (int i = 0; i < count; i++) {
+			tasks[i].proc = proc;
+			tasks[i].param = params[i];
+			tasks[i].remaining = &remaining;
+			tasks[i].done = done;
+			tasks[i].next = i + 1 < count ? &tasks[i + 1] : NULL;
+		}
+		EnterCriticalSection(&lock);
+		if (last == NULL) {
+			first = &tasks[1];
+		} else {
+			last->next = &tasks[1];
+		}
+		last = &tasks[count - 1];
+		LeaveCriticalSection(&lock);
+		ReleaseSemaphore(available, count - 1, NULL);
+
+		// parts queued before by other threads may be taken here as well
+		execute(&tasks[0]);
+		Task* task;
+		while (remaining > 0 && (task = pop()) != NULL) {
+			execute(task);
+		}
+		WaitForSingleObject(done, INFINITE);
+		CloseHandle(done);
+		delete[] tasks;
+	}
+};
+
+/**
+* Streaming calculation of the BLAKE3 hash (256 bit). The chunks of the input
+* are the leaves of a binary tree and hashed independently of each other: whole
+* chunks go to the SIMD chunk kernel, those of large updates are split among
+* helper threads. Their chaining values are merged into the tree in order.
+*/
+class Blake3 {
+private:
+	/** Chaining value of the chunk in progress */
+	UINT32 cv[8];
+	/** Number of the chunk in progress */
+	UINT64 chunkCounter;
+	/** Bytes of the current block of the chunk, zero padded */
+	BYTE block[64];
+	DWORD blockLength;
+	DWORD blocksCompressed;
+	/** Chaining values of the complete subtrees left of the chunk, one per level at most */
+	UINT32 stack[54][8];
+	int stackLength;
+
+	/**
+	* Part of the chunks hashed by one thread
+	*/
+	class ChunkWork {
+	public:
+		const BYTE* input;
+		size_t count;
+		UINT64 counter;
+		UINT32 (*cvs)[8];
+	};
+
+	static unsigned __stdcall chunkThread(void* param) {
+		ChunkWork* w = (ChunkWork*)param;
+		hashChunks(w->input, w->count, w->counter, w->cvs);
+		return 0;
+	}
+
+	void startChunk(UINT64 counter) {
+		memcpy(cv, blake3Iv, 32);
+		chunkCounter = counter;
+		memset(block, 0, sizeof(block));
+		blockLength = 0;
+		blocksCompressed = 0;
+	}
+
+	DWORD getChunkLength() {
+		return blocksCompressed * 64 + blockLength;
+	}
+
+	UINT32 getStartFlag() {
+		return blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0;
+	}
+
+	/**
+	* Adds the chaining value of a complete chunk, merging every complete subtree
+	* @param totalChunks Number of chunks including this one
+	*/
+	void addChunk(const UINT32 chunkCv[8], UINT64 totalChunks) {
+		UINT32 merged[8];
+		memcpy(merged, chunkCv, 32);
+		while ((totalChunks & 1) == 0) {
+			UINT32 words[16];
+			UINT32 out[16];
+			memcpy(words, stack[--stackLength], 32);
+			memcpy(words + 8, merged, 32);
+			blake3Compress(blake3Iv, words, 0, 64, BLAKE3_PARENT, out);
+			memcpy(merged, out, 32);
+			totalChunks >>= 1;
+		}
+		memcpy(stack[stackLength++], merged, 32);
+	}
+
+	/**
+	* Hashes whole chunks, with the helper threads if there are enough of them
+	*/
+	void addChunks(const BYTE* data, size_t count, HelperThreads* helpers) {
+		UINT32 (*cvs)[8] = new UINT32[count][8];
+		size_t parts = count / BLAKE3_PARALLEL_CHUNKS;
+		size_t threads = helpers != NULL ? helpers->getThreadCount() + 1 : 1;
+		if (parts > threads) {
+			parts = threads;
+		}
+		if (parts > 1) {
+			ChunkWork* work = new ChunkWork[parts];
+			void** params = new void*[parts];
+			size_t first = 0;
+			for (size_t i = 0; i < parts; i++) {
+				// whole groups of four keep the SIMD lanes busy
+				size_t next = i + 1 < parts ? count * (i + 1) / parts / 4 * 4 : count;
+				work[i].input = data + first * BLAKE3_CHUNK_SIZE;
+				work[i].count = next - first;
+				work[i].counter = chunkCounter + first;
+				work[i].cvs = cvs + first;
+				params[i] = &work[i];
+				first = next;
+			}
+			helpers->run(chunkThread, params, (int)parts);
+			delete[] params;
+			delete[] work;
+		} else {
+			hashChunks(data, count, chunkCounter, cvs);
+		}
+		for (size_t i = 0; i < count; i++) {
+			addChunk(cvs[i], chunkCounter + i + 1);
+		}
+		delete[] cvs;
+		startChunk(chunkCounter + count);
+	}
+
+	/**
+	* Adds bytes to the chunk in progress, they must not exceed the chunk
+	*/
+	void updateChunk(const BYTE* data, size_t size) {
+		while (size > 0) {
+			// a full block is only compressed when more bytes follow, the last one gets the end flag
+			if (blockLength == 64) {
+				UINT32 words[16];
+				UINT32 out[16];
+				memcpy(words, block, 64);
+				blake3Compress(cv, words, chunkCounter, 64, getStartFlag(), out);
+				memcpy(cv, out, 32);
+				blocksCompressed++;
+				memset(block, 0, sizeof(block));
+				blockLength = 0;
+			}
+			size_t take = 64 - blockLength < size ? 64 - blockLength : size;
+			memcpy(block + blockLength, data, take);
+			blockLength += (DWORD)take;
+			data += take;
+			size -= take;
+		}
+	}
+
+	/**
+	* Compresses the last block of the chunk in progress
+	*/
+	void finishChunk(UINT32 flags, UINT32 out[16]) {
+		UINT32 words[16];
+		memcpy(words, block, 64);
+		blake3Compress(cv, words, chunkCounter, blockLength, getStartFlag() | BLAKE3_CHUNK_END | flags, out);
+	}
+
+public:
+	Blake3() {
+		reset();
+	}
+
+	void reset() {
+		startChunk(0);
+		stackLength = 0;
+	}
+
+	/**
+	* Adds the data to the hash
+	* @param helpers Threads helping to hash the whole chunks, NULL for none
+	*/
+	void update(const BYTE* data, size_t size, HelperThreads* helpers) {
+		while (size > 0) {
+			// a full chunk is only added to the tree when more bytes follow, the last one may be the root
+			if (getChunkLength() == BLAKE3_CHUNK_SIZE) {
+				UINT32 out[16];
+				finishChunk(0, out);
+				addChunk(out, chunkCounter + 1);
+				startChunk(chunkCounter + 1);
+			}
+			if (getChunkLength() == 0 && size > BLAKE3_CHUNK_SIZE) {
+				size_t count = (size - 1) / BLAKE3_CHUNK_SIZE;
+				addChunks(data, count, helpers);
+				data += count * BLAKE3_CHUNK_SIZE;
+				size -= count * BLAKE3_CHUNK_SIZE;
+				continue;
+			}
+			size_t take = BLAKE3_CHUNK_SIZE - getChunkLength() < size ? BLAKE3_CHUNK_SIZE - getChunkLength() : size;
+			updateChunk(data, take);
+			data += take;
+			size -= take;
+		}
+	}
+
+	void finish(BYTE digest[BLAKE3_DIGEST_SIZE]) {
+		// the chunk in progress is the root, or the right edge below the parents on the stack
+		UINT32 inputCv[8];
+		UINT32 words[16];
+		UINT64 counter = chunkCounter;
+		DWORD length = blockLength;
+		UINT32 flags = getStartFlag() | BLAKE3_CHUNK_END;
+		memcpy(inputCv, cv, 32);
+		memcpy(words, block, 64);
+		for (int i = stackLength - 1; i >= 0; i--) {
+			UINT32 out[16];
+			blake3Compress(inputCv, words, counter, length, flags, out);
+			memcpy(words, stack[i], 32);
+			memcpy(words + 8, out, 32);
+			memcpy(inputCv, blake3Iv, 32);
+			counter = 0;
+			length = 64;
+			flags = BLAKE3_PARENT;
+		}
+		UINT32 out[16];
+		blake3Compress(inputCv, words, 0, length, flags | BLAKE3_ROOT, out);
+		memcpy(digest, out, BLAKE3_DIGEST_SIZE);
+	}
+};
+
+/**
+* Record of the persistent hash index. A file is identified by volume and file
+* index, the record is only valid while size and time stamps are unchanged.
+*/
+struct HashRecord {
+	DWORD volume;
+	/** Bit n marks prints[n] as valid, HASH_DIGEST_VALID the digest */
+	DWORD flags;
+	UINT64 fileIndex;
+	INT64 size;
+	UINT64 lastWrite;
+	UINT64 creation;
+	/** Prefilter fingerprints: head, tail and samples */
+	UINT64 prints[HASH_PRINT_COUNT];
+	BYTE digest[HASH_DIGEST_SIZE];
+	/** Fingerprint of all fields above, detects torn writes */
+	UINT64 checksum;
+};
+
+/**
+* Persistent index of file fingerprints and content hashes. The index file is
+* an append-only log of records, where later records supersede earlier ones.
+* The existing records are memory mapped, a torn tail after a crash is cut
+* off on load and the log is compacted once it holds mostly stale records.
+*/
+class HashIndex {
+private:
+	struct Header {
+		char magic[8];
+		DWORD version;
+		DWORD recordSize;
+	};
+
+	HANDLE hFile;
+	HANDLE hMapping;
+	LPVOID view;
+	/** Records of the index file mapped into memory */
+	const HashRecord* mapped;
+	int mappedCount;
+	/** Records added during this run */
+	HashRecord* added;
+	int addedCount;
+	int addedCapacity;
+	/** Number of added records already written to the index file */
+	int writtenCount;
+	/** Open addressing table of record numbers, -1 marks a free slot */
+	int* table;
+	int tableSize;
+	int liveCount;
+	LPWSTR fileName;
+	/** The index is shared by all compare workers */
+	CRITICAL_SECTION lock;
+
+	const HashRecord* record(int number) {
+		return number < mappedCount ? &mapped[number] : &added[number - mappedCount];
+	}
+
+	int slot(DWORD volume, UINT64 fileIndex) {
+		UINT64 hash = (fileIndex ^ ((UINT64)volume << 32)) * 0x9E3779B97F4A7C15ULL;
+		int i = (int)((hash >> 33) % (UINT64)tableSize);
+		while (table[i] != -1) {
+			const HashRecord* r = record(table[i]);
+			if (r->volume == volume && r->fileIndex == fileIndex) {
+				break;
+			}
+			i = (i + 1) % tableSize;
+		}
+		return i;
+	}
+
+	void insert(int number) {
+		if ((liveCount + 1) * 2 > tableSize) {
+			int* oldTable = table;
+			int oldSize = tableSize;
+			tableSize *= 2;
+			table = new int[tableSize];
+			for (int i = 0; i < tableSize; i++) {
+				table[i] = -1;
+			}
+			for (int i = 0; i < oldSize; i++) {
+				if (oldTable[i] != -1) {
+					const HashRecord* r = record(oldTable[i]);
+					table[slot(r->volume, r->fileIndex)] = oldTable[i];
+				}
+			}
+			delete[] oldTable;
+		}
+		const HashRecord* r = record(number);
+		int i = slot(r->volume, r->fileIndex);
+		if (table[i] == -1) {
+			liveCount++;
+		}
+		table[i] = number;
+	}
+
+	static UINT64 checksum(const HashRecord* r) {
+		return fingerprint((const BYTE*)r, offsetof(HashRecord, checksum));
+	}
+
+	void unmap() {
+		if (view != NULL) {
+			UnmapViewOfFile(view);
+			view = NULL;
+		}
+		if (hMapping != NULL) {
+			CloseHandle(hMapping);
+			hMapping = NULL;
+		}
+		mapped = NULL;
+	}
+
+	bool map() {
+		hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping != NULL) {
+			view = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		}
+		if (view == NULL) {
+			logError(GetLastError(), L"Unable to map index file \"%s\".", fileName);
+			unmap();
+			return false;
+		}
+		mapped = (const HashRecord*)((const BYTE*)view + sizeof(Header));
+		return true;
+	}
+
+	/**
+	* Writes all live records into a new index file which replaces the current one
+	*/
+	void compact() {
+		LPWSTR tempName = new wchar_t[wcslen(fileName) + 5];
+		wsprintf(tempName, L"%s.tmp", fileName);
+		HANDLE hTemp = CreateFile(tempName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hTemp == INVALID_HANDLE_VALUE) {
+			logError(GetLastError(), L"Unable to create index file \"%s\".", tempName);
+			delete[] tempName;
+			return;
+		}
+		Header header = { { 'D', 'F', 'H', 'L', 'I', 'D', 'X', '\0' }, INDEX_VERSION, sizeof(HashRecord) };
+		DWORD written;
+		bool success = WriteFile(hTemp, &header, sizeof(header), &written, NULL) != 0;
+		HashRecord* batch = new HashRecord[INDEX_FLUSH_RECORDS];
+		int batchCount = 0;
+		for (int i = 0; i <= tableSize && success; i++) {
+			if (i < tableSize && table[i] != -1) {
+				batch[batchCount++] = *record(table[i]);
+			}
+			if (batchCount == INDEX_FLUSH_RECORDS || (i == tableSize && batchCount > 0)) {
+				success = WriteFile(hTemp, batch, batchCount * sizeof(HashRecord), &written, NULL) != 0;
+				batchCount = 0;
+			}
+		}
+		delete[] batch;
+		success = success && FlushFileBuffers(hTemp);
+		CloseHandle(hTemp);
+
+		unmap();
+		CloseHandle(hFile);
+		hFile = INVALID_HANDLE_VALUE;
+		if (success && MoveFileEx(tempName, fileName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+			logVerbose(L"Compacted index file to %i records.", liveCount);
+		} else {
+			logError(GetLastError(), L"Unable to compact index file \"%s\".", fileName);
+			DeleteFile(tempName);
+		}
+		delete[] tempName;
+	}
+
+public:
+	HashIndex() {
+		hFile = INVALID_HANDLE_VALUE;
+		hMapping = NULL;
+		view = NULL;
+		mapped = NULL;
+		mappedCount = 0;
+		added = NULL;
+		addedCount = addedCapacity = writtenCount = 0;
+		tableSize = 1024;
+		table = new int[tableSize];
+		for (int i = 0; i < tableSize; i++) {
+			table[i] = -1;
+		}
+		liveCount = 0;
+		fileName = NULL;
+		InitializeCriticalSection(&lock);
+	}
+
+	~HashIndex() {
+		close();
+		DeleteCriticalSection(&lock);
+		delete[] table;
+		delete[] added;
+		delete[] fileName;
+	}
+
+	/**
+	* Opens or creates the index file and loads all valid records
+	* @param name File name of the index
+	* @return boolean value if the index could be opened
+	*/
+	bool open(LPCWSTR name) {
+		delete[] fileName;
+		fileName = new wchar_t[wcslen(name) + 1];
+		wcscpy(fileName, name);
+
+		hFile = CreateFile(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			logError(GetLastError(), L"Unable to open index file \"%s\".", fileName);
+			return false;
+		}
+
+		Header header = { { 'D', 'F', 'H', 'L', 'I', 'D', 'X', '\0' }, INDEX_VERSION, sizeof(HashRecord) };
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(hFile, &fileSize)) {
+			fileSize.QuadPart = 0;
+		}
+		INT64 validSize = sizeof(Header);
+		if (fileSize.QuadPart == 0) {
+			// new index, just write the header
+			DWORD written;
+			if (!WriteFile(hFile, &header, sizeof(header), &written, NULL)) {
+				logError(GetLastError(), L"Unable to write index file \"%s\".", fileName);
+				close();
+				return false;
+			}
+		} else {
+			if (fileSize.QuadPart < (INT64)sizeof(Header) || !map() ||
+				memcmp(view, &header, sizeof(header)) != 0) {
+					logError(L"File \"%s\" is not a valid index file of this version.", fileName);
+					close();
+					return false;
+			}
+
+			// the log ends at the first record which was not written completely
+			int total = (int)((fileSize.QuadPart - sizeof(Header)) / sizeof(HashRecord));
+			mappedCount = total;
+			int valid = 0;
+			while (valid < total && mapped[valid].checksum == checksum(&mapped[valid])) {
+				insert(valid);
+				valid++;
+			}
+			mappedCount = valid;
+			validSize = sizeof(Header) + (INT64)valid * sizeof(HashRecord);
+			if (validSize < fileSize.QuadPart) {
+				logInfo(L"Index file \"%s\" was not closed properly, dropping %i incomplete records.", fileName, total - valid);
+				unmap();
+				LARGE_INTEGER position;
+				position.QuadPart = validSize;
+				if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN) || !SetEndOfFile(hFile) || !map()) {
+					logError(GetLastError(), L"Unable to repair index file \"%s\".", fileName);
+					close();
+					return false;
+				}
+			}
+		}
+		LARGE_INTEGER position;
+		position.QuadPart = validSize;
+		SetFilePointerEx(hFile, position, NULL, FILE_BEGIN);
+		logVerbose(L"Loaded %i records from index file \"%s\".", liveCount, fileName);
+		return true;
+	}
+
+	/**
+	* Looks up the latest record of the given file
+	* @return boolean value if a record was found
+	*/
+	bool lookup(DWORD volume, UINT64 fileIndex, HashRecord& result) {
+		EnterCriticalSection(&lock);
+		int i = slot(volume, fileIndex);
+		bool found = table[i] != -1;
+		if (found) {
+			result = *record(table[i]);
+		}
+		LeaveCriticalSection(&lock);
+		return found;
+	}
+
+	/**
+	* Adds a new or updated record, records are written in batches
+	*/
+	void store(HashRecord& r) {
+		r.checksum = checksum(&r);
+		EnterCriticalSection(&lock);
+		if (addedCount == addedCapacity) {
+			addedCapacity = addedCapacity > 0 ? addedCapacity * 2 : INDEX_FLUSH_RECORDS;
+			HashRecord* newAdded = new HashRecord[addedCapacity];
+			if (addedCount > 0) {
+				memcpy(newAdded, added, addedCount * sizeof(HashRecord));
+			}
+			delete[] added;
+			added = newAdded;
+		}
+		added[addedCount++] = r;
+		insert(mappedCount + addedCount - 1);
+		if (addedCount - writtenCount >= INDEX_FLUSH_RECORDS) {
+			flush();
+		}
+		LeaveCriticalSection(&lock);
+	}
+
+	/**
+	* Appends all new records to the index file and flushes them to disk, the caller holds the lock
+	*/
+	void flush() {
+		if (hFile == INVALID_HANDLE_VALUE || writtenCount == addedCount) {
+			return;
+		}
+		DWORD written;
+		if (!WriteFile(hFile, &added[writtenCount], (addedCount - writtenCount) * sizeof(HashRecord), &written, NULL) ||
+			!FlushFileBuffers(hFile)) {
+				logError(GetLastError(), L"Unable to write index file \"%s\".", fileName);
+		}
+		writtenCount = addedCount;
+	}
+
+	/**
+	* Writes pending records and compacts the index file if most records are stale
+	*/
+	void close() {
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		flush();
+		int total = mappedCount + addedCount;
+		if (total >= INDEX_COMPACT_MIN && total > liveCount * 2) {
+			compact();
+		}
+		unmap();
+		if (hFile != INVALID_HANDLE_VALUE) {
+			CloseHandle(hFile);
+			hFile = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	int getSize() {
+		return liveCount;
+	}
+};
+
+/**
+* Token buckets limiting the bytes read, the reads and the metadata operations
+* per second of all threads. A bucket holds up to one second of its rate, a
+* request larger than that waits for a full bucket and leaves it in debt.
+* The limits are given like "bytes=50M,reads=200,meta=500" and can be changed
+* at runtime by writing new ones to the control file.
+*/
+class Throttle {
+public:
+	enum Bucket {
+		READ_BYTES,
+		READ_OPERATIONS,
+		METADATA_OPERATIONS,
+		BUCKET_COUNT
+	};
+
+private:
+	CRITICAL_SECTION lock;
+	/** Units per second of each bucket, 0 if not limited */
+	double rates[BUCKET_COUNT];
+	double tokens[BUCKET_COUNT];
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER lastRefill;
+	/** File the limits are read from when it changes, NULL if none */
+	LPWSTR controlFile;
+	FILETIME controlWrite;
+	DWORD lastCheck;
+	/** Time in ms all threads waited for tokens */
+	volatile LONG waited;
+
+	void refill() {
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		double seconds = (double)(now.QuadPart - lastRefill.QuadPart) / frequency.QuadPart;
+		lastRefill = now;
+		for (int i = 0; i < BUCKET_COUNT; i++) {
+			tokens[i] += rates[i] * seconds;
+			if (tokens[i] > rates[i]) {
+				tokens[i] = rates[i];
+			}
+		}
+	}
+
+	/**
+	* Reads the limits again if the control file was written since the last check
+	*/
+	void checkControlFile() {
+		if (controlFile == NULL || GetTickCount() - lastCheck < THROTTLE_CHECK) {
+			return;
+		}
+		lastCheck = GetTickCount();
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesEx(controlFile, GetFileExInfoStandard, &data) ||
+			CompareFileTime(&data.ftLastWriteTime, &controlWrite) == 0) {
+				return;
+		}
+		controlWrite = data.ftLastWriteTime;
+		HANDLE hFile = CreateFile(controlFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		char text[256];
+		DWORD read = 0;
+		if (ReadFile(hFile, text, sizeof(text) - 1, &read, NULL)) {
+			text[read] = 0;
+			char* end = text + strcspn(text, "\r\n");
+			*end = 0;
+			wchar_t limits[256];
+			mbstowcs(limits, text, 256);
+			if (parse(limits)) {
+				logInfo(L"Limits changed to \"%s\".", limits);
+			} else {
+				logError(L"Ignoring the limits \"%s\" of the control file.", limits);
+			}
+		}
+		CloseHandle(hFile);
+	}
+
+public:
+	Throttle() {
+		InitializeCriticalSection(&lock);
+		for (int i = 0; i < BUCKET_COUNT; i++) {
+			rates[i] = 0;
+			tokens[i] = 0;
+		}
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&lastRefill);
+		controlFile = NULL;
+		memset(&controlWrite, 0, sizeof(controlWrite));
+		lastCheck = GetTickCount() - THROTTLE_CHECK;
+		waited = 0;
+	}
+
+	~Throttle() {
+		delete[] controlFile;
+		DeleteCriticalSection(&lock);
+	}
+
+	/**
+	* Sets the limits given like "bytes=50M,reads=200,meta=500", K, M and G
+	* multiply by 1024. Limits not given stay as they are, 0 removes a limit.
+	* @return boolean value if all limits could be parsed
+	*/
+	bool parse(LPCWSTR limits) {
+		LPCWSTR names[BUCKET_COUNT] = { L"bytes", L"reads", L"meta" };
+		double newRates[BUCKET_COUNT];
+		for (int i = 0; i < BUCKET_COUNT; i++) {
+			newRates[i] = rates[i];
+		}
+		LPCWSTR entry = limits;
+		while (*entry != 0) {
+			LPCWSTR value = wcschr(entry, L'=');
+			if (value == NULL) {
+				return false;
+			}
+			int bucket = 0;
+			while (bucket < BUCKET_COUNT && (wcslen(names[bucket]) != (size_t)(value - entry) || _wcsnicmp(entry, names[bucket], value - entry) != 0)) {
+				bucket++;
+			}
+			if (bucket == BUCKET_COUNT) {
+				return false;
+			}
+			wchar_t* end;
+			double rate = wcstod(value + 1, &end);
+			// each unit falls through to the smaller ones
+			switch (*end) {
+			case L'G': case L'g':
+				rate *= 1024;
+			case L'M': case L'm':
+				rate *= 1024;
+			case L'K': case L'k':
+				rate *= 1024;
+				end++;
+				break;
+			}
+			if (end == value + 1 || rate < 0 || (*end != 0 && *end != L',')) {
+				return false;
+			}
+			newRates[bucket] = rate;
+			entry = *end == L',' ? end + 1 : end;
+		}
+		EnterCriticalSection(&lock);
+		refill();
+		for (int i = 0; i < BUCKET_COUNT; i++) {
+			if (newRates[i] != rates[i]) {
+				rates[i] = newRates[i];
+				tokens[i] = rates[i];
+			}
+		}
+		LeaveCriticalSection(&lock);
+		return true;
+	}
+
+	/**
+	* Setter for the control file, its limits are read at the next request
+	*/
+	void setControlFile(LPCWSTR newValue) {
+		delete[] controlFile;
+		controlFile = new wchar_t[wcslen(newValue) + 1];
+		wcscpy(controlFile, newValue);
+	}
+
+	/**
+	* Takes the tokens of a request, waits until the bucket has enough of them
+	*/
+	void acquire(Bucket bucket, double amount) {
+		DWORD start = GetTickCount();
+		EnterCriticalSection(&lock);
+		checkControlFile();
+		while (rates[bucket] > 0) {
+			refill();
+			double needed = amount < rates[bucket] ? amount : rates[bucket];
+			if (tokens[bucket] >= needed) {
+				tokens[bucket] -= amount;
+				break;
+			}
+			double wait = (needed - tokens[bucket]) * 1000 / rates[bucket];
+			LeaveCriticalSection(&lock);
+			Sleep(wait < THROTTLE_CHECK ? (DWORD)wait + 1 : THROTTLE_CHECK);
+			EnterCriticalSection(&lock);
+			checkControlFile();
+		}
+		LeaveCriticalSection(&lock);
+		DWORD time = GetTickCount() - start;
+		if (time > 0) {
+			InterlockedExchangeAdd(&waited, (LONG)time);
+		}
+	}
+
+	/**
+	* Getter for the time in ms all threads waited for the limits
+	*/
+	LONG getWaited() {
+		return waited;
+	}
+};
+
+/**
+* Schedules the reads of all compare workers per physical device. Each device
+* allows a limited number of reads in flight: many for solid state disks,
+* few for rotational disks where concurrent reads only cause head movements.
+*/
+class IoScheduler {
+public:
+	class Device {
+	public:
+		/** Disk number, or volume serial number for network shares */
+		DWORD id;
+		bool remote;
+		/** Flag if the device has a seek penalty */
+		bool rotational;
+		int queueDepth;
+		/** Largest block read at once */
+		DWORD maxBlock;
+		/** Semaphore counting the free read slots */
+		HANDLE slots;
+		Device* next;
+	};
+
+private:
+	/** Device of each volume seen so far */
+	class Volume {
+	public:
+		DWORD serial;
+		Device* device;
+		Volume* next;
+	};
+
+	/** Layout of DEVICE_SEEK_PENALTY_DESCRIPTOR, missing in older SDKs */
+	struct SeekPenaltyDescriptor {
+		DWORD Version;
+		DWORD Size;
+		BOOLEAN IncursSeekPenalty;
+	};
+
+	Device* devices;
+	Volume* volumes;
+	CRITICAL_SECTION lock;
+	/** Limits of all reads, NULL if not limited */
+	Throttle* throttle;
+
+public:
+	/**
+	* Asynchronous read at a given offset. Buffer and event of a request are
+	* reused for all reads of its owner.
+	*/
+	class Request {
+	public:
+		Device* device;
+		HANDLE hFile;
+		OVERLAPPED overlapped;
+		LPBYTE buffer;
+		DWORD size;
+		INT64 offset;
+		/** Number of bytes read, valid once the request is completed */
+		DWORD read;
+		BOOL result;
+		/** Flag if the read is in flight and holds a slot of its device */
+		bool pending;
+
+		Request() {
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			buffer = NULL;
+			pending = false;
+			result = FALSE;
+			read = 0;
+		}
+
+		~Request() {
+			CloseHandle(overlapped.hEvent);
+		}
+	};
+
+private:
+	/**
+	* Issues the read of a request which already got a slot of the device
+	*/
+	void issue(Request& r) {
+		if (throttle != NULL) {
+			throttle->acquire(Throttle::READ_OPERATIONS, 1);
+			throttle->acquire(Throttle::READ_BYTES, r.size);
+		}
+		ResetEvent(r.overlapped.hEvent);
+		r.overlapped.Offset = (DWORD)r.offset;
+		r.overlapped.OffsetHigh = (DWORD)(r.offset >> 32);
+		r.read = 0;
+		r.result = ReadFile(r.hFile, r.buffer, r.size, NULL, &r.overlapped);
+		if (r.result || GetLastError() == ERROR_IO_PENDING) {
+			r.pending = true;
+		} else {
+			// failed right away, the slot is free again
+			ReleaseSemaphore(r.device->slots, 1, NULL);
+			r.pending = false;
+		}
+	}
+
+	/**
+	* Finds the physical disk of the volume the file is on and if it has a seek penalty
+	* @param remote Set if the file is on a network share
+	* @return boolean value if the disk could be determined, false for network shares and
+	* local volumes whose disk is unknown, like VHDs, RAM disks or volumes that may not be opened
+	*/
+	static bool queryDevice(LPCWSTR file, DWORD& disk, bool& rotational, bool& remote) {
+		wchar_t root[MAX_PATH];
+		wchar_t volumeName[MAX_PATH];
+		remote = false;
+		if (!GetVolumePathName(file, root, MAX_PATH)) {
+			// a UNC path like \\server\share, not a device path starting with \\?\ or \\.\ as well
+			remote = file[0] == L'\\' && file[1] == L'\\' && file[2] != L'?' && file[2] != L'.';
+			return false;
+		}
+		if (GetDriveType(root) == DRIVE_REMOTE) {
+			remote = true;
+			return false;
+		}
+		if (!GetVolumeNameForVolumeMountPoint(root, volumeName, MAX_PATH)) {
+			return false;
+		}
+
+		// open the volume itself, without trailing backslash
+		size_t len = wcslen(volumeName);
+		if (len > 0 && volumeName[len - 1] == L'\\') {
+			volumeName[len - 1] = 0;
+		}
+		HANDLE hVolume = CreateFile(volumeName, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+		if (hVolume == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		// a volume spanning several disks is scheduled on its first disk
+		DWORD bytes;
+		VOLUME_DISK_EXTENTS extents;
+		bool found = DeviceIoControl(hVolume, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0, &extents, sizeof(extents), &bytes, NULL) ||
+			GetLastError() == ERROR_MORE_DATA;
+		if (found) {
+			disk = extents.Extents[0].DiskNumber;
+
+			// StorageDeviceSeekPenaltyProperty is known since Windows 7, assume a rotational disk before
+			STORAGE_PROPERTY_QUERY query;
+			memset(&query, 0, sizeof(query));
+			query.PropertyId = (STORAGE_PROPERTY_ID)7;
+			query.QueryType = PropertyStandardQuery;
+			SeekPenaltyDescriptor penalty;
+			rotational = !DeviceIoControl(hVolume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &penalty, sizeof(penalty), &bytes, NULL) ||
+				bytes < sizeof(penalty) || penalty.IncursSeekPenalty;
+		}
+		CloseHandle(hVolume);
+		return found;
+	}
+
+public:
+	IoScheduler() {
+		devices = NULL;
+		volumes = NULL;
+		throttle = NULL;
+		InitializeCriticalSection(&lock);
+	}
+
+	~IoScheduler() {
+		while (volumes != NULL) {
+			Volume* v = volumes;
+			volumes = v->next;
+			delete v;
+		}
+		while (devices != NULL) {
+			Device* dev = devices;
+			devices = dev->next;
+			CloseHandle(dev->slots);
+			delete dev;
+		}
+		DeleteCriticalSection(&lock);
+	}
+
+	/**
+	* Setter for the limits of all reads, NULL for none
+	*/
+	void setThrottle(Throttle* newThrottle) {
+		throttle = newThrottle;
+	}
+
+	/**
+	* Getter for the limits of all reads and file opens, NULL if not limited
+	*/
+	Throttle* getThrottle() {
+		return throttle;
+	}
+
+	/**
+	* Gets the device of the given file
+	* @param volumeSerial Serial number of the volume the file is on
+	* @param file File name, used to find the physical disk of a volume seen the first time
+	*/
+	Device* getDevice(DWORD volumeSerial, LPCWSTR file) {
+		EnterCriticalSection(&lock);
+		Volume* v = volumes;
+		while (v != NULL && v->serial != volumeSerial) {
+			v = v->next;
+		}
+		if (v == NULL) {
+			DWORD id = volumeSerial;
+			bool rotational = false;
+			bool remote;
+			if (!queryDevice(file, id, rotational, remote)) {
+				// without a known disk the volume is a device of its own, local ones read like a rotational disk
+				id = volumeSerial;
+				rotational = !remote;
+				if (!remote) {
+					logVerbose(L"The disk of volume %08X is unknown, it's read like a rotational disk.", volumeSerial);
+				}
+			}
+			Device* dev = devices;
+			while (dev != NULL && (dev->id != id || dev->remote != remote)) {
+				dev = dev->next;
+			}
+			if (dev == NULL) {
+				dev = new Device();
+				dev->id = id;
+				dev->remote = remote;
+				dev->rotational = rotational;
+				dev->queueDepth = remote ? REMOTE_QUEUE_DEPTH : rotational ? ROTATIONAL_QUEUE_DEPTH : SSD_QUEUE_DEPTH;
+				dev->maxBlock = remote ? REMOTE_BLOCK_SIZE : rotational ? ROTATIONAL_BLOCK_SIZE : SSD_BLOCK_SIZE;
+				dev->slots = CreateSemaphore(NULL, dev->queueDepth, dev->queueDepth, NULL);
+				dev->next = devices;
+				devices = dev;
+				logVerbose(L"Reading from %s %u with %i reads in flight of up to %u KB", remote ? L"network share" : rotational ? L"rotational disk" : L"solid state disk",
+					id, dev->queueDepth, dev->maxBlock / 1024);
+			}
+			v = new Volume();
+			v->serial = volumeSerial;
+			v->device = dev;
+			v->next = volumes;
+			volumes = v;
+		}
+		LeaveCriticalSection(&lock);
+		return v->device;
+	}
+
+	/**
+	* Starts the read if the device has a free slot
+	* @return boolean value if the read was started (or failed right away)
+	*/
+	bool tryStart(Request& r) {
+		if (WaitForSingleObject(r.device->slots, 0) != WAIT_OBJECT_0) {
+			return false;
+		}
+		issue(r);
+		return true;
+	}
+
+	/**
+	* Starts the read as soon as the device has a free slot. Only to be
+	* called by threads with no reads in flight, otherwise they may wait
+	* for slots they hold themselves.
+	*/
+	void start(Request& r) {
+		WaitForSingleObject(r.device->slots, INFINITE);
+		issue(r);
+	}
+
+	/**
+	* Waits for the read to be finished and frees its slot
+	*/
+	void complete(Request& r) {
+		if (r.pending) {
+			r.result = GetOverlappedResult(r.hFile, &r.overlapped, &r.read, TRUE);
+			DWORD error = GetLastError();
+			r.pending = false;
+			ReleaseSemaphore(r.device->slots, 1, NULL);
+			SetLastError(error);
+		}
+	}
+
+	/**
+	* Reads synchronously, the calling thread must not have other reads in flight
+	*/
+	BOOL read(Request& r) {
+		start(r);
+		complete(r);
+		return r.result;
+	}
+
+	/**
+	* Scheduling policy: on rotational disks the files of a group are read in
+	* alternating order, so the head does not have to go back for every file
+	*/
+	bool alternateReads(Device* device) {
+		return device->rotational;
+	}
+};
+
+/**
+* Page aligned buffers for the unbuffered reads of all compare threads. The
+* memory of all buffers, free ones included, stays within a global budget,
+* a thread waits until others give back enough of it. Buffers given back are
+* kept for the next groups.
+*/
+class BufferPool {
+private:
+	CRITICAL_SECTION lock;
+	size_t budget;
+	/** Bytes of all buffers, handed out or free */
+	size_t used;
+	size_t peak;
+	LPBYTE* freeBuffers;
+	size_t* freeSizes;
+	int freeCount;
+	int freeCapacity;
+	/** Released once for each thread waiting for budget when a buffer is given back */
+	HANDLE returned;
+	int waiting;
+
+	void releaseFree() {
+		for (int i = 0; i < freeCount; i++) {
+			VirtualFree(freeBuffers[i], 0, MEM_RELEASE);
+			used -= freeSizes[i];
+		}
+		freeCount = 0;
+	}
+
+public:
+	BufferPool(size_t newBudget) {
+		InitializeCriticalSection(&lock);
+		budget = newBudget;
+		used = peak = 0;
+		freeCapacity = 16;
+		freeBuffers = new LPBYTE[freeCapacity];
+		freeSizes = new size_t[freeCapacity];
+		freeCount = 0;
+		returned = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+		waiting = 0;
+	}
+
+	~BufferPool() {
+		releaseFree();
+		delete[] freeBuffers;
+		delete[] freeSizes;
+		if (returned != NULL) {
+			CloseHandle(returned);
+		}
+		DeleteCriticalSection(&lock);
+	}
+
+	/**
+	* Hands out a buffer of at least minimum bytes, as close to wanted as the
+	* budget allows. If minimum exceeds the budget, it's handed out as soon as
+	* no other buffer is in use.
+	* @param size Filled with the size of the buffer, it may be larger than wanted
+	*/
+	LPBYTE acquire(size_t minimum, size_t wanted, size_t& size) {
+		while (true) {
+			EnterCriticalSection(&lock);
+
+			// the smallest free buffer large enough
+			int best = -1;
+			for (int i = 0; i < freeCount; i++) {
+				if (freeSizes[i] >= wanted && (best < 0 || freeSizes[i] < freeSizes[best])) {
+					best = i;
+				}
+			}
+			if (best >= 0) {
+				LPBYTE result = freeBuffers[best];
+				size = freeSizes[best];
+				freeCount--;
+				freeBuffers[best] = freeBuffers[freeCount];
+				freeSizes[best] = freeSizes[freeCount];
+				LeaveCriticalSection(&lock);
+				return result;
+			}
+
+			// otherwise the free buffers make room for a new one
+			if (used + wanted > budget) {
+				releaseFree();
+			}
+			size_t available = used < budget ? (budget - used) / FIRST_BLOCK_SIZE * FIRST_BLOCK_SIZE : 0;
+			if (available >= minimum || used == 0) {
+				size = wanted < available ? wanted : (available > minimum ? available : minimum);
+				used += size;
+				if (used > peak) {
+					peak = used;
+				}
+				LeaveCriticalSection(&lock);
+				LPBYTE result = (LPBYTE)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+				if (result == NULL) {
+					EnterCriticalSection(&lock);
+					used -= size;
+					LeaveCriticalSection(&lock);
+					throw L"Unable to allocate compare buffers.";
+				}
+				return result;
+			}
+
+			// a buffer in use is given back before long, the budget is checked again then
+			if (returned == NULL) {
+				LeaveCriticalSection(&lock);
+				Sleep(1);
+				continue;
+			}
+			waiting++;
+			LeaveCriticalSection(&lock);
+			WaitForSingleObject(returned, INFINITE);
+		}
+	}
+
+	/**
+	* Gives a buffer back, it's kept for the next request
+	*/
+	void release(LPBYTE buffer, size_t size) {
+		EnterCriticalSection(&lock);
+		if (freeCount == freeCapacity) {
+			freeBuffers = resizeArray(freeBuffers, freeCount, freeCapacity * 2);
+			freeSizes = resizeArray(freeSizes, freeCount, freeCapacity * 2);
+			freeCapacity *= 2;
+		}
+		freeBuffers[freeCount] = buffer;
+		freeSizes[freeCount] = size;
+		freeCount++;
+		if (waiting > 0) {
+			ReleaseSemaphore(returned, waiting, NULL);
+			waiting = 0;
+		}
+		LeaveCriticalSection(&lock);
+	}
+
+	/**
+	* Getter for the bytes all buffers may take
+	*/
+	size_t getBudget() {
+		return budget;
+	}
+
+	/**
+	* Getter for the largest number of bytes taken by the buffers at once
+	*/
+	size_t getPeak() {
+		return peak;
+	}
+};
+
+/**
+* Compares all files of a group with equal size at once. The files are read
+* in lockstep block by block and the group is split into sub groups as soon
+* as the contents diverge, so each byte of each file is read only once.
+*/
+class GroupComparer {
+public:
+	/** Stages in which the files of a group can turn out to be different */
+	enum Stage {
+		HEAD_STAGE,		// Fingerprint of the first chunk
+		TAIL_STAGE,		// Fingerprint of the last chunk
+		SAMPLE_STAGE,	// Fingerprints of chunks sampled from the interior
+		FULL_STAGE,		// Full byte compare
+		STAGE_COUNT
+	};
+
+private:
+	class Member {
+	public:
+		LPCWSTR name;
+		HANDLE hFile;
+		BY_HANDLE_FILE_INFORMATION info;
+		/** State of the file, EQUAL as long as it matches at least one other file */
+		CompareResult state;
+		/** First member of the sub group this file's content matched so far */
+		int subGroup;
+		LPBYTE block;
+		DWORD read;
+		/** Bytes of the file read by the block compare so far */
+		INT64 total;
+		/** Reads of the next blocks, used as a ring */
+		IoScheduler::Request* ring;
+		/** Mapping and view of the current window when compared memory mapped */
+		HANDLE hMapping;
+		LPVOID view;
+		/** Number of blocks issued so far */
+		int issued;
+		/** Fingerprint of the chunk read in the current prefilter stage */
+		UINT64 print;
+		/** Device the file is read from */
+		IoScheduler::Device* device;
+		/** Index record of the file, updated with every fingerprint calculated */
+		HashRecord record;
+		/** Flag if the record needs to be written to the index */
+		bool dirty;
+		/** Flag if the sub group of the file is already known from the index */
+		bool resolved;
+		ContentHash hash;
+		Blake3 blake;
+		/** Content hash given in the results */
+		ContentDigest digest;
+	};
+
+	/** buffer for the blocks of all members of the current group, taken from the pool */
+	LPBYTE buffer;
+	size_t bufferSize;
+	BufferPool* pool;
+	/** buffer for the prefilter chunks */
+	LPBYTE chunk;
+	IoScheduler::Request chunkRequest;
+	/** Read requests of all members */
+	IoScheduler::Request* requests;
+	int requestCount;
+	/** Number of blocks read ahead per file */
+	int readAhead;
+	/** Files up to this size are compared memory mapped, -1 for all files */
+	INT64 mapThreshold;
+	/** Policy choosing the file all equal files are linked to */
+	TargetPolicy targetPolicy;
+	/** Folder the target should be below with PREFERRED_ROOT */
+	LPCWSTR preferredRoot;
+	/** Order the members of the current group are read in, NULL for member order */
+	const int* readOrder;
+	/** Content hash the files are grouped by, NO_HASH for the byte compare */
+	HashMethod hashMethod;
+	/** Flag if the files are compared byte by byte besides the hash */
+	bool verifyBytes;
+	/** Threads helping to hash the chunks of large blocks with BLAKE3, NULL for none */
+	HelperThreads* hashHelpers;
+	/** Files up to this size are read whole in one batch per group, 0 for none */
+	INT64 batchLimit;
+
+	/** Layout of WIN32_MEMORY_RANGE_ENTRY, missing in older SDKs */
+	struct MemoryRange {
+		PVOID VirtualAddress;
+		SIZE_T NumberOfBytes;
+	};
+	typedef BOOL (WINAPI *PrefetchVirtualMemoryProc)(HANDLE hProcess, ULONG_PTR NumberOfEntries, MemoryRange* VirtualAddresses, ULONG Flags);
+	/** PrefetchVirtualMemory, available since Windows 8 */
+	PrefetchVirtualMemoryProc prefetchVirtualMemory;
+	DWORD pageSize;
+	/** Number of files dropped in each stage */
+	INT64 eliminated[STAGE_COUNT];
+	/** Flag if attributes of file need to match */
+	bool attributeMustMatch;
+	/** Flag if timestamps of file need to match */
+	bool dateTimeMustMatch;
+	/** Index of fingerprints from earlier runs, NULL if not used */
+	HashIndex* index;
+	/** Scheduler all reads go through */
+	IoScheduler* scheduler;
+	/** Number of fingerprints and content hashes taken from the index */
+	INT64 indexPrints;
+	INT64 indexDigests;
+
+	/** Byte range of a file */
+	class Range {
+	public:
+		INT64 start;
+		INT64 end;
+	};
+	/** Allocated ranges of the sparse files of the current group */
+	Range* ranges;
+	int rangeCount;
+	int rangeCapacity;
+	/** Block read from all files of the current group */
+	class Block {
+	public:
+		INT64 offset;
+		DWORD length;
+	};
+	/** Blocks of the current group if it is compared sparse, holes in all files are left out */
+	Block* blocks;
+	int blockCount;
+	int blockCapacity;
+	/** Flag if the current group is read by the planned blocks instead of completely */
+	bool sparse;
+	/** Bytes of holes not read in sparse files */
+	INT64 holeBytes;
+	/** Flag if the files of the current group are read through the file cache */
+	bool cached;
+	/** Bytes read through the file cache, each page of them may have displaced a cached page of another process */
+	INT64 cachedBytes;
+	/** Files up to FIRST_BLOCK_SIZE compared and the performance counter ticks it took, block by block [0] and in batches [1] */
+	INT64 smallFiles[2];
+	INT64 smallTicks[2];
+
+	/** Sort key of a file read in a batch */
+	class BatchKey {
+	public:
+		int subGroup;
+		UINT64 print;
+		int member;
+	};
+
+	void drop(Member& m, CompareResult reason) {
+		unmapWindow(m);
+		if (m.hMapping != NULL) {
+			CloseHandle(m.hMapping);
+			m.hMapping = NULL;
+		}
+		if (m.ring != NULL) {
+			// no reads may be in flight when the handle gets closed
+			CancelIo(m.hFile);
+			for (int i = 0; i < readAhead; i++) {
+				scheduler->complete(m.ring[i]);
+			}
+			m.ring = NULL;
+		}
+		if (m.hFile != INVALID_HANDLE_VALUE) {
+			CloseHandle(m.hFile);
+			m.hFile = INVALID_HANDLE_VALUE;
+		}
+		m.state = reason;
+	}
+
+	/**
+	* Compare kernel call guarded against in-page errors, which are raised
+	* when a mapped file gets truncated or its volume fails
+	* @return offset of the first difference, COMPARE_FAILED on an in-page error
+	*/
+	static size_t compareGuarded(const BYTE* block1, const BYTE* block2, size_t length) {
+		__try {
+			return compareBlocks(block1, block2, length);
+		} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+			return COMPARE_FAILED;
+		}
+	}
+
+	/**
+	* Hash update guarded against in-page errors
+	*/
+	static bool hashGuarded(ContentHash& hash, const BYTE* data, size_t length) {
+		__try {
+			hash.update(data, length);
+			return true;
+		} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+			return false;
+		}
+	}
+
+	/**
+	* BLAKE3 update guarded against in-page errors
+	*/
+	static bool hashGuarded(Blake3& hash, const BYTE* data, size_t length, HelperThreads* helpers) {
+		__try {
+			hash.update(data, length, helpers);
+			return true;
+		} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+			return false;
+		}
+	}
+
+	/**
+	* Updates the content hashes of the member with its current block
+	* @return boolean value if the block could be hashed
+	*/
+	bool hashBlock(Member& m, bool mapped) {
+		if ((index != NULL || hashMethod == MURMUR_HASH) && !hashGuarded(m.hash, m.block, m.read)) {
+			return false;
+		}
+		// in-page errors are only caught on the own thread, mapped views are hashed without helpers
+		if (hashMethod == BLAKE3_HASH && !sparse && !hashGuarded(m.blake, m.block, m.read, mapped ? NULL : hashHelpers)) {
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	* Touches every page of a mapped view, guarded against in-page errors
+	* @return boolean value if all pages could be read
+	*/
+	static bool touchPages(const BYTE* view, size_t length, DWORD pageSize) {
+		__try {
+			volatile BYTE sum = 0;
+			for (size_t i = 0; i < length; i += pageSize) {
+				sum ^= view[i];
+			}
+			return true;
+		} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+			return false;
+		}
+	}
+
+	void unmapWindow(Member& m) {
+		if (m.view != NULL) {
+			UnmapViewOfFile(m.view);
+			m.view = NULL;
+		}
+	}
+
+	/**
+	* Maps the given window of the file instead of reading it. The pages are
+	* prefetched in one go and touched in order, the equivalent of a
+	* sequential access hint.
+	* @return boolean value if the window could be mapped and paged in
+	*/
+	bool mapWindow(Member& m, INT64 offset, DWORD length) {
+		unmapWindow(m);
+		if (m.hMapping == NULL) {
+			m.hMapping = CreateFileMapping(m.hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (m.hMapping == NULL) {
+				return false;
+			}
+		}
+		Throttle* throttle = scheduler->getThrottle();
+		if (throttle != NULL) {
+			throttle->acquire(Throttle::READ_OPERATIONS, 1);
+			throttle->acquire(Throttle::READ_BYTES, length);
+		}
+		m.view = MapViewOfFile(m.hMapping, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, length);
+		if (m.view == NULL) {
+			return false;
+		}
+		cachedBytes += length;
+		if (prefetchVirtualMemory != NULL) {
+			MemoryRange range;
+			range.VirtualAddress = m.view;
+			range.NumberOfBytes = length;
+			prefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+		}
+		m.block = (LPBYTE)m.view;
+		m.read = length;
+		return touchPages(m.block, length, pageSize);
+	}
+
+	bool isBelowPreferredRoot(Member& m) {
+		size_t length = wcslen(preferredRoot);
+		return _wcsnicmp(m.name, preferredRoot, length) == 0
+			&& (m.name[length] == L'\\' || (length > 0 && preferredRoot[length - 1] == L'\\'));
+	}
+
+	/**
+	* Target policy: checks if the file is a better target than the current one
+	*/
+	bool isBetterTarget(Member& m, Member& current) {
+		if (targetPolicy == OLDEST) {
+			INT64 time = m.info.ftLastWriteTime.dwLowDateTime + ((INT64)MAXDWORD + 1) * m.info.ftLastWriteTime.dwHighDateTime;
+			INT64 currentTime = current.info.ftLastWriteTime.dwLowDateTime + ((INT64)MAXDWORD + 1) * current.info.ftLastWriteTime.dwHighDateTime;
+			if (time != currentTime) {
+				return time < currentTime;
+			}
+		} else if (targetPolicy == PREFERRED_ROOT && isBelowPreferredRoot(m) != isBelowPreferredRoot(current)) {
+			return isBelowPreferredRoot(m);
+		}
+		return m.info.nNumberOfLinks > current.info.nNumberOfLinks;
+	}
+
+	/**
+	* Drops all members which are the only one left in their sub group
+	* @return number of members still being compared
+	*/
+	int dropSingles(Member* members, int count, int* groupSizes, CompareResult reason) {
+		for (int i = 0; i < count; i++) {
+			groupSizes[i] = 0;
+		}
+		for (int i = 0; i < count; i++) {
+			if (members[i].state == EQUAL) {
+				groupSizes[members[i].subGroup]++;
+			}
+		}
+		int active = 0;
+		for (int i = 0; i < count; i++) {
+			if (members[i].state == EQUAL) {
+				if (groupSizes[members[i].subGroup] < 2) {
+					drop(members[i], reason);
+				} else {
+					active++;
+				}
+			}
+		}
+		return active;
+	}
+
+	/**
+	* Allocates memory usable for unbuffered reads
+	*/
+	static LPBYTE allocateAligned(size_t size) {
+		LPBYTE result = (LPBYTE)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (result == NULL) {
+			throw L"Unable to allocate compare buffers.";
+		}
+		return result;
+	}
+
+	/**
+	* Index of the member read at a position of the read order
+	*/
+	int memberAt(int position) {
+		return readOrder != NULL ? readOrder[position] : position;
+	}
+
+	/**
+	* Member read at a position of the read order
+	*/
+	Member& visit(Member* members, int position) {
+		return members[memberAt(position)];
+	}
+
+	/**
+	* Reads one small chunk of all members still being compared and splits
+	* the group by the fingerprints of the chunks
+	* @param slot Number of the fingerprint in the index records
+	* @return number of members still being compared
+	*/
+	int prefilter(Member* members, int count, int* scratch, int active, INT64 offset, Stage stage, int slot) {
+		chunkRequest.buffer = chunk;
+		chunkRequest.size = PREFILTER_BLOCK_SIZE;
+		chunkRequest.offset = offset / PREFILTER_BLOCK_SIZE * PREFILTER_BLOCK_SIZE;
+		for (int i = 0; i < count; i++) {
+			Member& m = visit(members, i);
+			if (m.state != EQUAL) {
+				continue;
+			}
+			if (m.record.flags & (1 << slot)) {
+				m.print = m.record.prints[slot];
+				indexPrints++;
+				continue;
+			}
+			chunkRequest.device = m.device;
+			chunkRequest.hFile = m.hFile;
+			if (!scheduler->read(chunkRequest) || chunkRequest.read == 0) {
+				logError(GetLastError(), L"Read error on file \"%s\".", m.name);
+				drop(m, DIFFERENT);
+				continue;
+			}
+			DWORD read = chunkRequest.read;
+			if (cached) {
+				cachedBytes += read;
+			}
+			m.print = fingerprint(chunk, read) ^ read;
+			if (index != NULL) {
+				m.record.prints[slot] = m.print;
+				m.record.flags |= 1 << slot;
+				m.dirty = true;
+			}
+		}
+
+		for (int j = 0; j < count; j++) {
+			Member& m = members[j];
+			if (m.state != EQUAL) {
+				continue;
+			}
+			scratch[j] = j;
+			for (int i = 0; i < j; i++) {
+				Member& other = members[i];
+				if (other.state == EQUAL && scratch[i] == i && other.subGroup == m.subGroup && other.print == m.print) {
+					scratch[j] = i;
+					break;
+				}
+			}
+		}
+		for (int j = 0; j < count; j++) {
+			if (members[j].state == EQUAL) {
+				members[j].subGroup = scratch[j];
+			}
+		}
+
+		int remaining = dropSingles(members, count, scratch, DIFFERENT);
+		eliminated[stage] += active - remaining;
+		return remaining;
+	}
+
+	/**
+	* Splits all sub groups whose members all have a content hash in the index
+	* by these hashes, those members don't need to be read at all
+	* @return number of members still being compared
+	*/
+	int resolveFromIndex(Member* members, int count, int* scratch, int active) {
+		for (int i = 0; i < count; i++) {
+			scratch[i] = 1;
+		}
+		for (int i = 0; i < count; i++) {
+			if (members[i].state == EQUAL && !(members[i].record.flags & HASH_DIGEST_VALID)) {
+				scratch[members[i].subGroup] = 0;
+			}
+		}
+		for (int i = 0; i < count; i++) {
+			members[i].resolved = members[i].state == EQUAL && scratch[members[i].subGroup] == 1;
+		}
+		for (int j = 0; j < count; j++) {
+			Member& m = members[j];
+			if (!m.resolved) {
+				continue;
+			}
+			indexDigests++;
+			scratch[j] = j;
+			for (int i = 0; i < j; i++) {
+				Member& other = members[i];
+				if (other.resolved && scratch[i] == i && other.subGroup == m.subGroup &&
+					memcmp(other.record.digest, m.record.digest, HASH_DIGEST_SIZE) == 0) {
+						scratch[j] = i;
+						break;
+				}
+			}
+		}
+		for (int j = 0; j < count; j++) {
+			if (members[j].resolved) {
+				members[j].subGroup = scratch[j];
+			}
+		}
+		int remaining = dropSingles(members, count, scratch, DIFFERENT);
+		eliminated[FULL_STAGE] += active - remaining;
+		return remaining;
+	}
+
+	/**
+	* Finishes the content hashes of the members. Hashes of files read only in
+	* part are not valid, only the ones resolved from the index are known then.
+	* @param complete Flag if the files were read completely
+	*/
+	void finishDigests(Member* members, int count, bool complete) {
+		for (int j = 0; j < count; j++) {
+			Member& m = members[j];
+			if (m.state != EQUAL || (!m.resolved && !complete)) {
+				continue;
+			}
+			if (!m.resolved && (index != NULL || hashMethod == MURMUR_HASH)) {
+				m.hash.finish(m.record.digest);
+				m.record.flags |= HASH_DIGEST_VALID;
+				m.dirty = true;
+			}
+			if (hashMethod == MURMUR_HASH) {
+				memcpy(m.digest.bytes, m.record.digest, HASH_DIGEST_SIZE);
+				m.digest.method = MURMUR_HASH;
+			} else if (hashMethod == BLAKE3_HASH && !m.resolved) {
+				m.blake.finish(m.digest.bytes);
+				m.digest.method = BLAKE3_HASH;
+			}
+		}
+	}
+
+	/**
+	* Splits the sub groups by the content hashes of their members
+	* @return number of members still being compared
+	*/
+	int splitByDigest(Member* members, int count, int* scratch, int active) {
+		for (int j = 0; j < count; j++) {
+			Member& m = members[j];
+			if (m.state != EQUAL) {
+				continue;
+			}
+			scratch[j] = j;
+			for (int i = 0; i < j; i++) {
+				Member& other = members[i];
+				if (other.state == EQUAL && scratch[i] == i && other.subGroup == m.subGroup &&
+					memcmp(other.digest.bytes, m.digest.bytes, BLAKE3_DIGEST_SIZE) == 0) {
+						scratch[j] = i;
+						break;
+				}
+			}
+		}
+		for (int j = 0; j < count; j++) {
+			if (members[j].state == EQUAL) {
+				members[j].subGroup = scratch[j];
+			}
+		}
+		int remaining = dropSingles(members, count, scratch, DIFFERENT);
+		eliminated[FULL_STAGE] += active - remaining;
+		return remaining;
+	}
+
+	static int __cdecl compareBatchKeys(const void* key1, const void* key2) {
+		const BatchKey* k1 = (const BatchKey*)key1;
+		const BatchKey* k2 = (const BatchKey*)key2;
+		if (k1->subGroup != k2->subGroup) {
+			return k1->subGroup < k2->subGroup ? -1 : 1;
+		}
+		if (k1->print != k2->print) {
+			return k1->print < k2->print ? -1 : 1;
+		}
+		return k1->member < k2->member ? -1 : (k1->member > k2->member ? 1 : 0);
+	}
+
+	/**
+	* Reads the members of a group of small files whole into the buffer, one
+	* slot per member, with as many reads in flight as the devices allow. The
+	* files are sorted by the fingerprints of their contents, only files with
+	* equal fingerprints are compared byte by byte.
+	* @param slot Bytes of the buffer per member
+	* @return number of members still being compared
+	*/
+	int compareBatch(Member* members, int count, int* scratch, int active, INT64 size, size_t slot) {
+		// Issue all reads, if the device has no free slot the oldest own read is completed first
+		int oldest = 0;
+		for (int k = 0; k < count; k++) {
+			int j = memberAt(k);
+			Member& m = members[j];
+			if (m.state != EQUAL || m.resolved) {
+				continue;
+			}
+			IoScheduler::Request& r = requests[j];
+			r.device = m.device;
+			r.hFile = m.hFile;
+			r.buffer = buffer + slot * j;
+			r.size = (DWORD)slot;
+			r.offset = 0;
+			while (!scheduler->tryStart(r)) {
+				while (oldest < k && !requests[memberAt(oldest)].pending) {
+					oldest++;
+				}
+				if (oldest == k) {
+					scheduler->start(r);
+					break;
+				}
+				scheduler->complete(requests[memberAt(oldest)]);
+			}
+		}
+
+		BatchKey* keys = new BatchKey[count];
+		int keyCount = 0;
+		for (int j = 0; j < count; j++) {
+			Member& m = members[j];
+			if (m.state != EQUAL || m.resolved) {
+				continue;
+			}
+			IoScheduler::Request& r = requests[j];
+			scheduler->complete(r);
+			m.block = r.buffer;
+			m.read = r.read;
+			if (!r.result || m.read != size || !hashBlock(m, false)) {
+				logError(L"Read error on file \"%s\"! This _should_ not happen!?!?", m.name);
+				drop(m, DIFFERENT);
+				continue;
+			}
+			if (cached) {
+				cachedBytes += m.read;
+			}
+			m.print = fingerprint(m.block, m.read);
+			keys[keyCount].subGroup = m.subGroup;
+			keys[keyCount].print = m.print;
+			keys[keyCount].member = j;
+			keyCount++;
+		}
+
+		// every file joins the first file of its sub group with the same fingerprint and content
+		qsort(keys, keyCount, sizeof(BatchKey), compareBatchKeys);
+		for (int a = 0; a < keyCount; ) {
+			int b = a + 1;
+			while (b < keyCount && keys[b].subGroup == keys[a].subGroup && keys[b].print == keys[a].print) {
+				b++;
+			}
+			for (int x = a; x < b; x++) {
+				int j = keys[x].member;
+				scratch[j] = j;
+				for (int y = a; y < x; y++) {
+					int i = keys[y].member;
+					if (scratch[i] == i && compareBlocks(members[i].block, members[j].block, members[j].read) == members[j].read) {
+						scratch[j] = i;
+						break;
+					}
+				}
+			}
+			a = b;
+		}
+		for (int x = 0; x < keyCount; x++) {
+			members[keys[x].member].subGroup = scratch[keys[x].member];
+		}
+		delete[] keys;
+
+		int remaining = dropSingles(members, count, scratch, DIFFERENT);
+		eliminated[FULL_STAGE] += active - remaining;
+		return remaining;
+	}
+
+	/**
+	* Size of the given block before the end of the file. The first block is
+	* small to find differences fast, the blocks grow while the files still
+	* match, up to the limit.
+	*/
+	static DWORD grownLength(int block, DWORD blockLimit) {
+		DWORD length = FIRST_BLOCK_SIZE;
+		for (int k = 0; k < block && length < blockLimit; k++) {
+			length *= BLOCK_GROWTH;
+		}
+		return length < blockLimit ? length : blockLimit;
+	}
+
+	/**
+	* Offset of the given block
+	*/
+	INT64 blockOffset(int block, DWORD blockLimit) {
+		if (sparse) {
+			return blocks[block].offset;
+		}
+		INT64 offset = 0;
+		for (int k = 0; k < block; k++) {
+			DWORD length = grownLength(k, blockLimit);
+			if (length == blockLimit) {
+				return offset + (INT64)(block - k) * blockLimit;
+			}
+			offset += length;
+		}
+		return offset;
+	}
+
+	/**
+	* Bytes requested for the given block, it may end behind the end of the file
+	*/
+	DWORD blockLength(int block, DWORD blockLimit) {
+		if (sparse) {
+			return blocks[block].length;
+		}
+		return grownLength(block, blockLimit);
+	}
+
+	/**
+	* @return boolean value if the given block is still to be read
+	*/
+	bool hasBlock(int block, INT64 size, DWORD blockLimit) {
+		return sparse ? block < blockCount : blockOffset(block, blockLimit) < size;
+	}
+
+	static int __cdecl compareRanges(const void* range1, const void* range2) {
+		INT64 start1 = ((const Range*)range1)->start;
+		INT64 start2 = ((const Range*)range2)->start;
+		return start1 < start2 ? -1 : (start1 > start2 ? 1 : 0);
+	}
+
+	/**
+	* Appends the allocated ranges of a sparse file to the ranges of the group
+	* @return boolean value if all ranges could be queried
+	*/
+	bool addAllocatedRanges(Member& m, INT64 size) {
+		FILE_ALLOCATED_RANGE_BUFFER query;
+		query.FileOffset.QuadPart = 0;
+		query.Length.QuadPart = size;
+		FILE_ALLOCATED_RANGE_BUFFER found[64];
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (overlapped.hEvent == NULL) {
+			return false;
+		}
+		bool complete = false;
+		while (!complete) {
+			// the unbuffered handles are asynchronous, the query has to wait for its result
+			DWORD bytes = 0;
+			BOOL success = DeviceIoControl(m.hFile, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), found, sizeof(found), &bytes, &overlapped);
+			if (!success && GetLastError() == ERROR_IO_PENDING) {
+				success = GetOverlappedResult(m.hFile, &overlapped, &bytes, TRUE);
+			}
+			int n = bytes / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+			if (!success && (GetLastError() != ERROR_MORE_DATA || n == 0)) {
+				break;
+			}
+			complete = success != FALSE;
+			for (int i = 0; i < n; i++) {
+				if (rangeCount == rangeCapacity) {
+					ranges = resizeArray(ranges, rangeCount, rangeCapacity * 2);
+					rangeCapacity *= 2;
+				}
+				ranges[rangeCount].start = found[i].FileOffset.QuadPart;
+				ranges[rangeCount].end = found[i].FileOffset.QuadPart + found[i].Length.QuadPart;
+				rangeCount++;
+			}
+			if (!complete) {
+				query.FileOffset.QuadPart = ranges[rangeCount - 1].end;
+				query.Length.QuadPart = size - query.FileOffset.QuadPart;
+			}
+		}
+		CloseHandle(overlapped.hEvent);
+		return complete;
+	}
+
+	/**
+	* Plans the blocks of a group of sparse files. Only the ranges allocated in at
+	* least one of the files are read, holes in all files are zero in all of them.
+	* Files which are not sparse have no holes, groups with one of them are read
+	* completely.
+	* @return bytes to read per file
+	*/
+	INT64 planBlocks(Member* members, int count, INT64 size, DWORD blockLimit) {
+		sparse = false;
+		if (size <= BLOCK_SIZE) {
+			return size;
+		}
+		for (int i = 0; i < count; i++) {
+			Member& m = members[i];
+			if (m.state == EQUAL && !m.resolved && !(m.info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+				return size;
+			}
+		}
+		rangeCount = 0;
+		for (int i = 0; i < count; i++) {
+			Member& m = members[i];
+			if (m.state == EQUAL && !m.resolved && !addAllocatedRanges(m, size)) {
+				logDebug(L"Unable to query the allocated ranges of \"%s\", reading the group completely.", m.name);
+				return size;
+			}
+		}
+
+		// whole first blocks keep the unbuffered reads and the mapped views aligned
+		for (int i = 0; i < rangeCount; i++) {
+			ranges[i].start = ranges[i].start / FIRST_BLOCK_SIZE * FIRST_BLOCK_SIZE;
+			ranges[i].end = (ranges[i].end + FIRST_BLOCK_SIZE - 1) / FIRST_BLOCK_SIZE * FIRST_BLOCK_SIZE;
+		}
+		qsort(ranges, rangeCount, sizeof(Range), compareRanges);
+
+		// merge the overlapping ranges and split them into blocks
+		blockCount = 0;
+		INT64 bytes = 0;
+		for (int i = 0; i < rangeCount; ) {
+			INT64 start = ranges[i].start;
+			INT64 end = ranges[i].end;
+			for (i++; i < rangeCount && ranges[i].start <= end; i++) {
+				if (ranges[i].end > end) {
+					end = ranges[i].end;
+				}
+			}
+			while (start < end && start < size) {
+				DWORD length = grownLength(blockCount, blockLimit);
+				if (end - start < length) {
+					length = (DWORD)(end - start);
+				}
+				if (blockCount == blockCapacity) {
+					blocks = resizeArray(blocks, blockCount, blockCapacity * 2);
+					blockCapacity *= 2;
+				}
+				blocks[blockCount].offset = start;
+				blocks[blockCount].length = length;
+				blockCount++;
+				bytes += size - start < length ? size - start : length;
+				start += length;
+			}
+		}
+		sparse = true;
+		return bytes;
+	}
+
+	/**
+	* Keeps readAhead blocks of the file in flight. If the device has no free
+	* slot, the oldest own read is completed first to free one.
+	*/
+	void readAheadBlocks(Member* members, int count, Member& m, int round, INT64 size, DWORD blockLimit) {
+		while (m.issued < round + readAhead && hasBlock(m.issued, size, blockLimit)) {
+			IoScheduler::Request& r = m.ring[m.issued % readAhead];
+			r.device = m.device;
+			r.hFile = m.hFile;
+			r.offset = blockOffset(m.issued, blockLimit);
+			r.size = blockLength(m.issued, blockLimit);
+			if (!scheduler->tryStart(r)) {
+				IoScheduler::Request* oldest = NULL;
+				for (int ahead = 0; ahead < readAhead && oldest == NULL; ahead++) {
+					for (int i = 0; i < count && oldest == NULL; i++) {
+						Member& other = members[i];
+						if (other.ring != NULL && other.ring[(round + ahead) % readAhead].pending) {
+							oldest = &other.ring[(round + ahead) % readAhead];
+						}
+					}
+				}
+				if (oldest != NULL) {
+					scheduler->complete(*oldest);
+					continue;
+				}
+				scheduler->start(r);
+			}
+			m.issued++;
+		}
+	}
+
+	/**
+	* @return number of members which still need to be read
+	*/
+	int countReading(Member* members, int count) {
+		int reading = 0;
+		for (int i = 0; i < count; i++) {
+			if (members[i].state == EQUAL && !members[i].resolved) {
+				reading++;
+			}
+		}
+		return reading;
+	}
+
+	/**
+	* Checks if the two files need to be kept apart because of the attribute or time stamp filters
+	*/
+	bool detailsDiffer(Member& m1, Member& m2) {
+		if (attributeMustMatch && m1.info.dwFileAttributes != m2.info.dwFileAttributes) {
+			return true;
+		}
+		if (dateTimeMustMatch && (
+			m1.info.ftLastWriteTime.dwHighDateTime != m2.info.ftLastWriteTime.dwHighDateTime ||
+			m1.info.ftLastWriteTime.dwLowDateTime != m2.info.ftLastWriteTime.dwLowDateTime
+			)) {
+				return true;
+		}
+		return false;
+	}
+
+public:
+	GroupComparer(bool newAttributeMustMatch, bool newDateTimeMustMatch, HashIndex* newIndex, IoScheduler* newScheduler, BufferPool* newPool) {
+		buffer = NULL;
+		bufferSize = 0;
+		pool = newPool;
+		chunk = NULL;
+		requests = NULL;
+		requestCount = 0;
+		readAhead = READ_AHEAD;
+		mapThreshold = (INT64)MAP_THRESHOLD * 1048576;
+		targetPolicy = MOST_LINKS;
+		preferredRoot = NULL;
+		readOrder = NULL;
+		hashMethod = NO_HASH;
+		verifyBytes = false;
+		hashHelpers = NULL;
+		batchLimit = (INT64)BATCH_FILE_SIZE * 1024;
+		prefetchVirtualMemory = (PrefetchVirtualMemoryProc)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "PrefetchVirtualMemory");
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		pageSize = systemInfo.dwPageSize;
+		attributeMustMatch = newAttributeMustMatch;
+		dateTimeMustMatch = newDateTimeMustMatch;
+		index = newIndex;
+		scheduler = newScheduler;
+		indexPrints = indexDigests = 0;
+		for (int i = 0; i < STAGE_COUNT; i++) {
+			eliminated[i] = 0;
+		}
+		rangeCapacity = blockCapacity = 64;
+		ranges = new Range[rangeCapacity];
+		blocks = new Block[blockCapacity];
+		rangeCount = blockCount = 0;
+		sparse = false;
+		holeBytes = 0;
+		cached = false;
+		cachedBytes = 0;
+		smallFiles[0] = smallFiles[1] = 0;
+		smallTicks[0] = smallTicks[1] = 0;
+	}
+
+	~GroupComparer() {
+		if (chunk != NULL) {
+			VirtualFree(chunk, 0, MEM_RELEASE);
+		}
+		delete[] requests;
+		delete[] ranges;
+		delete[] blocks;
+	}
+
+	/**
+	* Setter for the number of blocks read ahead per file
+	*/
+	void setReadAhead(int newValue) {
+		readAhead = newValue;
+	}
+
+	/**
+	* Setter for the size up to which files are compared memory mapped, -1 for all files
+	*/
+	void setMapThreshold(INT64 newValue) {
+		mapThreshold = newValue;
+	}
+
+	/**
+	* Setter for the policy choosing the target of equal files
+	* @param newRoot Folder the target should be below with PREFERRED_ROOT
+	*/
+	void setTargetPolicy(TargetPolicy newPolicy, LPCWSTR newRoot) {
+		targetPolicy = newPolicy;
+		preferredRoot = newRoot;
+	}
+
+	/**
+	* Setter for the content hash the files are grouped by
+	* @param newVerify Flag if the files are compared byte by byte as well
+	* @param newHelpers Threads helping to hash the chunks of large blocks, NULL for none
+	*/
+	void setHashMethod(HashMethod newMethod, bool newVerify, HelperThreads* newHelpers) {
+		hashMethod = newMethod;
+		verifyBytes = newVerify;
+		hashHelpers = newHelpers;
+	}
+
+	/**
+	* Setter for the size up to which files are read whole in one batch per group, 0 for none
+	*/
+	void setBatchLimit(INT64 newValue) {
+		batchLimit = newValue;
+	}
+
+	/**
+	* Getter for the number of files found to be different in the given stage
+	*/
+	INT64 getEliminated(Stage stage) {
+		return eliminated[stage];
+	}
+
+	/**
+	* Getter for the number of prefilter fingerprints taken from the index
+	*/
+	INT64 getIndexPrints() {
+		return indexPrints;
+	}
+
+	/**
+	* Getter for the number of files whose content hash was taken from the index
+	*/
+	INT64 getIndexDigests() {
+		return indexDigests;
+	}
+
+	/**
+	* Getter for the bytes of holes in sparse files which were not read
+	*/
+	INT64 getHoleBytes() {
+		return holeBytes;
+	}
+
+	/**
+	* Getter for the bytes read through the file cache
+	*/
+	INT64 getCachedBytes() {
+		return cachedBytes;
+	}
+
+	/**
+	* Getter for the number of files up to FIRST_BLOCK_SIZE compared
+	* @param batched Flag for the files read in batches instead of block by block
+	*/
+	INT64 getSmallFiles(bool batched) {
+		return smallFiles[batched ? 1 : 0];
+	}
+
+	/**
+	* Getter for the performance counter ticks the compare of the files up to FIRST_BLOCK_SIZE took
+	*/
+	INT64 getSmallTicks(bool batched) {
+		return smallTicks[batched ? 1 : 0];
+	}
+
+	/**
+	* Compares the content of the given files
+	* @param names File names of the group members
+	* @param folders Handles of the folders of the files, they are opened relative
+	*        to them. NULL or INVALID_HANDLE_VALUE to open them by name.
+	* @param count Number of files in the group
+	* @param size Size of each of the files
+	* @param targets Filled with the member each file is to be linked to, the
+	*        own index for the targets and -1 for files without duplicate
+	* @param order Members in the order their blocks are read, NULL for member order.
+	*        The target chosen doesn't depend on it.
+	* @param digests Filled with the content hash of each file, NULL if not needed
+	* @return number of duplicates found
+	*/
+	int compareGroup(LPCWSTR* names, const HANDLE* folders, int count, INT64 size, int* targets, const int* order, ContentDigest* digests) {
+		readOrder = order;
+		sparse = false;
+		LARGE_INTEGER groupStart;
+		QueryPerformanceCounter(&groupStart);
+		Member* members = new Member[count];
+		int* groupSizes = new int[count];
+		int active = 0;
+
+		// Small files are read whole in one batch, through the cache unless no file is to be mapped
+		bool buffered = mapThreshold != 0;
+		size_t align = buffered ? 64 : pageSize;
+		size_t slot = (size_t)((size + align - 1) / align * align);
+		if (slot == 0) {
+			slot = align;
+		}
+		bool batch = size <= batchLimit && (INT64)slot * count <= (INT64)pool->getBudget();
+
+		// Mapped files go through the cache, the others are read unbuffered and asynchronous
+		bool mapped = !batch && (mapThreshold < 0 || size <= mapThreshold);
+		cached = mapped || (batch && buffered);
+		DWORD flags = mapped ? FILE_FLAG_SEQUENTIAL_SCAN : (cached ? 0 : FILE_FLAG_NO_BUFFERING) | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED;
+		ULONG options = NT_FILE_NON_DIRECTORY_FILE | NT_FILE_SEQUENTIAL_ONLY | (mapped ? NT_FILE_SYNCHRONOUS_IO_NONALERT : cached ? 0 : NT_FILE_NO_INTERMEDIATE_BUFFERING);
+
+		// Open all files and check file system information details...
+		for (int i = 0; i < count; i++) {
+			Member& m = members[i];
+			m.name = names[i];
+			m.state = EQUAL;
+			m.subGroup = i;
+			m.read = 0;
+			m.total = 0;
+			m.ring = NULL;
+			m.issued = 0;
+			m.hMapping = NULL;
+			m.view = NULL;
+			m.dirty = false;
+			m.resolved = false;
+			memset(&m.record, 0, sizeof(m.record));
+			memset(&m.digest, 0, sizeof(m.digest));
+			m.digest.method = NO_HASH;
+			if (scheduler->getThrottle() != NULL) {
+				scheduler->getThrottle()->acquire(Throttle::METADATA_OPERATIONS, 1);
+			}
+			if (folders != NULL && folders[i] != INVALID_HANDLE_VALUE) {
+				m.hFile = openRelative(folders[i], wcsrchr(m.name, L'\\') + 1, FILE_GENERIC_READ, FILE_SHARE_READ, options);
+			} else {
+				m.hFile = CreateFile(m.name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, flags, NULL);
+			}
+			if (m.hFile == INVALID_HANDLE_VALUE) {
+				logError(L"Unable to open file \"%s\"", m.name);
+				m.state = DIFFERENT;
+				continue;
+			}
+			if (!GetFileInformationByHandle(m.hFile, &m.info)) {
+				logInfo(L"Unable to read further file information of \"%s\", skipping.", m.name);
+				drop(m, SKIP);
+				continue;
+			}
+			m.device = scheduler->getDevice(m.info.dwVolumeSerialNumber, m.name);
+
+			// Fingerprints from the index are only valid as long as the file was not modified
+			if (index != NULL) {
+				DWORD volume = m.info.dwVolumeSerialNumber;
+				UINT64 fileIndex = ((UINT64)m.info.nFileIndexHigh << 32) | m.info.nFileIndexLow;
+				UINT64 lastWrite = ((UINT64)m.info.ftLastWriteTime.dwHighDateTime << 32) | m.info.ftLastWriteTime.dwLowDateTime;
+				UINT64 creation = ((UINT64)m.info.ftCreationTime.dwHighDateTime << 32) | m.info.ftCreationTime.dwLowDateTime;
+				if (!index->lookup(volume, fileIndex, m.record) ||
+					m.record.size != size || m.record.lastWrite != lastWrite || m.record.creation != creation) {
+						memset(&m.record, 0, sizeof(m.record));
+						m.record.volume = volume;
+						m.record.fileIndex = fileIndex;
+						m.record.size = size;
+						m.record.lastWrite = lastWrite;
+						m.record.creation = creation;
+				}
+			}
+
+			for (int j = 0; j < i; j++) {
+				Member& other = members[j];
+				if (other.state != EQUAL) {
+					continue;
+				}
+
+				// First check if the files are already hard-linked...
+				if (m.info.dwVolumeSerialNumber == other.info.dwVolumeSerialNumber &&
+					m.info.nFileIndexHigh == other.info.nFileIndexHigh &&
+					m.info.nFileIndexLow == other.info.nFileIndexLow) {
+
+						logVerbose(L"Files \"%s\" and \"%s\" are already hard linked, skipping.", other.name, m.name);
+						drop(m, SAME);
+						break;
+				}
+
+				// ... then join the sub group of the first file with matching attributes and time stamps
+				if (m.subGroup == i && other.subGroup == j && !detailsDiffer(m, other)) {
+					m.subGroup = j;
+				}
+			}
+		}
+		active = dropSingles(members, count, groupSizes, SKIP);
+
+		// Cheap checks first: most files differ in their first or last chunk already
+		if (size > FIRST_BLOCK_SIZE && active > 1) {
+			if (chunk == NULL) {
+				chunk = allocateAligned(PREFILTER_BLOCK_SIZE);
+			}
+			active = prefilter(members, count, groupSizes, active, 0, HEAD_STAGE, 0);
+			if (active > 1) {
+				active = prefilter(members, count, groupSizes, active, size - 1, TAIL_STAGE, 1);
+			}
+			if (size > BLOCK_SIZE) {
+				for (int k = 1; k <= PREFILTER_SAMPLES && active > 1; k++) {
+					active = prefilter(members, count, groupSizes, active, size / (PREFILTER_SAMPLES + 1) * k, SAMPLE_STAGE, 1 + k);
+				}
+			}
+		}
+
+		// Files unchanged since an earlier run don't need to be read again, the index has no BLAKE3 hashes
+		if (index != NULL && active > 1 && hashMethod != BLAKE3_HASH) {
+			active = resolveFromIndex(members, count, groupSizes, active);
+		}
+		int reading = countReading(members, count);
+
+		// Blocks grow up to the smallest limit of the device classes read from
+		DWORD blockLimit = 0;
+		for (int i = 0; i < count; i++) {
+			Member& m = members[i];
+			if (m.state == EQUAL && !m.resolved && (blockLimit == 0 || m.device->maxBlock < blockLimit)) {
+				blockLimit = m.device->maxBlock;
+			}
+		}
+		if (blockLimit == 0) {
+			blockLimit = BLOCK_SIZE;
+		}
+
+		// Share the address space between all mapped views, or the pooled buffer between all blocks in flight
+		int blocks = mapped ? reading : batch ? count : reading * readAhead;
+		if (mapped && reading > 0 && (size_t)blockLimit * blocks > GROUP_BUFFER_SIZE) {
+			blockLimit = (DWORD)(GROUP_BUFFER_SIZE / blocks / FIRST_BLOCK_SIZE * FIRST_BLOCK_SIZE);
+			if (blockLimit < FIRST_BLOCK_SIZE) {
+				blockLimit = FIRST_BLOCK_SIZE;
+			}
+		}
+		if (batch && reading > 1) {
+			buffer = pool->acquire(slot * count, slot * count, bufferSize);
+		} else if (!mapped && reading > 1) {
+			buffer = pool->acquire((size_t)FIRST_BLOCK_SIZE * blocks, (size_t)blockLimit * blocks, bufferSize);
+			if (bufferSize / blocks < blockLimit) {
+				blockLimit = (DWORD)(bufferSize / blocks / FIRST_BLOCK_SIZE * FIRST_BLOCK_SIZE);
+			}
+		}
+		if (!mapped && requestCount < blocks) {
+			delete[] requests;
+			requests = new IoScheduler::Request[blocks];
+			requestCount = blocks;
+		}
+		LPBYTE nextBlock = buffer;
+		IoScheduler::Request* nextRequest = requests;
+		for (int i = 0; i < count; i++) {
+			if (members[i].state == EQUAL && !members[i].resolved && !mapped && !batch) {
+				members[i].ring = nextRequest;
+				for (int k = 0; k < readAhead; k++) {
+					nextRequest->buffer = nextBlock;
+					nextRequest++;
+					nextBlock += blockLimit;
+				}
+			}
+		}
+
+		// Read File Content and compare
+		DWORD start = GetTickCount();
+		INT64 offset = 0;
+		INT64 bytesRead = 0;
+		INT64 bytesToRead = reading > 1 ? planBlocks(members, count, size, blockLimit) : size;
+		if (sparse) {
+			logVerbose(L"Sparse files, reading %I64i of %I64i bytes in %i blocks.", bytesToRead, size, blockCount);
+			holeBytes += (size - bytesToRead) * reading;
+		}
+		// sparse files are not read completely, their blocks are compared instead
+		bool hashOnly = hashMethod != NO_HASH && !verifyBytes && !sparse && !batch;
+		if (batch && reading > 1) {
+			active = compareBatch(members, count, groupSizes, active, size, slot);
+			bytesRead = size * reading;
+			bytesToRead = 0;
+		}
+		int round = 0;
+		bool alternate = false;
+		for (int i = 0; i < count; i++) {
+			if (members[i].state == EQUAL && !members[i].resolved && scheduler->alternateReads(members[i].device)) {
+				alternate = true;
+			}
+		}
+		while (bytesToRead > 0 && reading > 1 && hasBlock(round, size, blockLimit)) {
+			offset = blockOffset(round, blockLimit);
+
+			// Keep the next blocks in flight - the scheduler decides if we start with another file each round
+			for (int k = 0; k < count; k++) {
+				Member& m = visit(members, alternate ? (k + round) % count : k);
+				if (m.state == EQUAL && !m.resolved && !mapped) {
+					readAheadBlocks(members, count, m, round, size, blockLimit);
+				}
+			}
+
+			// Wait for the current blocks
+			for (int k = 0; k < count; k++) {
+				Member& m = visit(members, alternate ? (k + round) % count : k);
+				if (m.state != EQUAL || m.resolved) {
+					continue;
+				}
+				bool success;
+				if (mapped) {
+					INT64 windowOffset = blockOffset(round, blockLimit);
+					DWORD length = blockLength(round, blockLimit);
+					if (size - windowOffset < length) {
+						length = (DWORD)(size - windowOffset);
+					}
+					success = mapWindow(m, windowOffset, length);
+				} else {
+					IoScheduler::Request& r = m.ring[round % readAhead];
+					scheduler->complete(r);
+					m.block = r.buffer;
+					m.read = r.read;
+					success = r.result && m.read > 0;
+				}
+				if (!success || !hashBlock(m, mapped)) {
+					logError(L"Read error on file \"%s\"! This _should_ not happen!?!?", m.name);
+					drop(m, DIFFERENT);
+					continue;
+				}
+				bytesRead += m.read;
+				m.total += m.read;
+			}
+
+			// change the state for the next read operation
+			round++;
+
+			// Compare Data, every file joins the first file of its sub group with the same block content.
+			// Without the byte compare only the content hashes split the sub groups, at the end.
+			for (int j = 0; j < count; j++) {
+				Member& m = members[j];
+				if (m.state != EQUAL || m.resolved) {
+					continue;
+				}
+				int subGroup = hashOnly ? m.subGroup : j;
+				for (int i = 0; i < j && !hashOnly; i++) {
+					Member& other = members[i];
+					if (other.state == EQUAL && !other.resolved && groupSizes[i] == i && other.subGroup == m.subGroup) {
+						size_t differ = compareGuarded(other.block, m.block, other.read < m.read ? other.read : m.read);
+						if (differ == COMPARE_FAILED) {
+							// the file leaves the group as a single
+							logError(L"Read error on file \"%s\" or \"%s\"!", other.name, m.name);
+							break;
+						}
+						if (other.read == m.read && differ == m.read) {
+							subGroup = i;
+							break;
+						}
+						logDebug(L"Files \"%s\" and \"%s\" differ at offset %I64i", other.name, m.name, offset + (INT64)differ);
+					}
+				}
+				// groupSizes is used as scratch space for the new sub group until the round is finished
+				groupSizes[j] = subGroup;
+			}
+			DWORD read = 0;
+			for (int j = 0; j < count; j++) {
+				if (members[j].state == EQUAL && !members[j].resolved) {
+					members[j].subGroup = groupSizes[j];
+					read = members[j].read;
+				}
+			}
+			bytesToRead -= read;
+			int remaining = dropSingles(members, count, groupSizes, DIFFERENT);
+			eliminated[FULL_STAGE] += active - remaining;
+			active = remaining;
+			reading = countReading(members, count);
+		}
+
+		DWORD time = GetTickCount() - start;
+		logDebug(L"group compare (%s) took %ims, %I64i KB/s", batch ? L"batched" : mapped ? L"mapped" : L"unbuffered", time, time>0?bytesRead*1000 / time / 1024:0);
+
+		// Without the byte compare only the hashes of files read to their end tell them equal,
+		// a file that got shorter while it was read is not linked
+		bool complete = bytesToRead <= 0 && !sparse;
+		if (hashOnly && active > 1) {
+			for (int j = 0; j < count; j++) {
+				Member& m = members[j];
+				if (m.state == EQUAL && !m.resolved && (!complete || m.total != size)) {
+					logError(L"File \"%s\" was read with %I64i of %I64i bytes only, it's not linked.", m.name, m.total, size);
+					drop(m, DIFFERENT);
+				}
+			}
+			int remaining = dropSingles(members, count, groupSizes, DIFFERENT);
+			eliminated[FULL_STAGE] += active - remaining;
+			active = remaining;
+		}
+
+		// Files read completely get their content hashes
+		finishDigests(members, count, complete);
+		if (hashOnly && complete && active > 1) {
+			active = splitByDigest(members, count, groupSizes, active);
+		}
+
+		// All files still active are equal to the other files of their sub group, which are linked to the best target
+		for (int j = 0; j < count; j++) {
+			groupSizes[j] = -1;
+			targets[j] = -1;
+		}
+		for (int j = 0; j < count; j++) {
+			Member& m = members[j];
+			if (m.state == EQUAL && (groupSizes[m.subGroup] < 0 || isBetterTarget(m, members[groupSizes[m.subGroup]]))) {
+				groupSizes[m.subGroup] = j;
+			}
+		}
+		int found = 0;
+		for (int j = 0; j < count; j++) {
+			Member& m = members[j];
+			if (m.state != EQUAL) {
+				continue;
+			}
+			int target = groupSizes[m.subGroup];
+			targets[j] = target;
+			if (target != j) {
+				logVerbose(L"Files \"%s\" and \"%s\" are equal, hard link possible.", members[target].name, m.name);
+				found++;
+			}
+		}
+		if (digests != NULL) {
+			for (int j = 0; j < count; j++) {
+				digests[j] = members[j].digest;
+			}
+		}
+
+		// Remember the fingerprints and content hashes for the next run
+		if (index != NULL) {
+			for (int j = 0; j < count; j++) {
+				if (members[j].dirty) {
+					index->store(members[j].record);
+				}
+			}
+		}
+
+		for (int j = 0; j < count; j++) {
+			drop(members[j], members[j].state);
+		}
+		if (buffer != NULL) {
+			pool->release(buffer, bufferSize);
+			buffer = NULL;
+			bufferSize = 0;
+		}
+
+		delete[] groupSizes;
+		delete[] members;
+		if (size <= FIRST_BLOCK_SIZE) {
+			LARGE_INTEGER groupEnd;
+			QueryPerformanceCounter(&groupEnd);
+			smallFiles[batch ? 1 : 0] += count;
+			smallTicks[batch ? 1 : 0] += groupEnd.QuadPart - groupStart.QuadPart;
+		}
+		return found;
+	}
+};
+
+/**
+* Intent journal of the link phase. Before a batch of links is created, the
+* temporary names are written and flushed in one go, the end of the batch is
+* marked when all its links are done. Links left incomplete by a crash are
+* found by recover().
+*
+* Records are lines of UTF-16 text: "L<tab>sequence<tab>temporary name<tab>name"
+* for each link and "D<tab>sequence" when all links up to sequence are done.
+*/
+class Journal {
+private:
+	HANDLE hFile;
+	LPWSTR fileName;
+	/** Sequence number of the last link written */
+	DWORD sequence;
+	/** Records not written yet */
+	LPWSTR pending;
+	size_t pendingLength;
+	size_t pendingCapacity;
+
+	void append(LPCWSTR text) {
+		size_t length = wcslen(text);
+		if (pendingLength + length > pendingCapacity) {
+			size_t newCapacity = pendingCapacity > 0 ? pendingCapacity : 65536;
+			while (newCapacity < pendingLength + length) {
+				newCapacity *= 2;
+			}
+			pending = resizeArray(pending, pendingLength, newCapacity);
+			pendingCapacity = newCapacity;
+		}
+		memcpy(pending + pendingLength, text, length * sizeof(wchar_t));
+		pendingLength += length;
+	}
+
+	/**
+	* Writes all pending records to the journal
+	* @param flush Flag if the records must be on disk before returning
+	*/
+	bool write(bool flush) {
+		DWORD bytes = (DWORD)(pendingLength * sizeof(wchar_t));
+		DWORD written;
+		bool success = WriteFile(hFile, pending, bytes, &written, NULL) && written == bytes;
+		pendingLength = 0;
+		if (success && flush) {
+			success = FlushFileBuffers(hFile) != 0;
+		}
+		return success;
+	}
+
+	/**
+	* Splits the next field off the line
+	* @return start of the field, NULL if the line has no more fields
+	*/
+	static LPWSTR nextField(LPWSTR& line) {
+		if (line == NULL) {
+			return NULL;
+		}
+		LPWSTR field = line;
+		line = wcschr(line, L'\t');
+		if (line != NULL) {
+			*line++ = 0;
+		}
+		return field;
+	}
+public:
+	/**
+	* Starts a new journal. An existing journal with entries must be recovered first.
+	* @return boolean value if the journal could be created
+	*/
+	bool open(LPCWSTR newFileName) {
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (GetFileAttributesEx(newFileName, GetFileExInfoStandard, &data) && (data.nFileSizeLow > 0 || data.nFileSizeHigh > 0)) {
+			logError(L"Journal \"%s\" has entries of an earlier run, recover them with /x first.", newFileName);
+			return false;
+		}
+		hFile = CreateFile(newFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			logError(L"Unable to create journal \"%s\": %i", newFileName, GetLastError());
+			return false;
+		}
+		fileName = new wchar_t[wcslen(newFileName) + 1];
+		wcscpy(fileName, newFileName);
+		sequence = 0;
+		return true;
+	}
+
+	/**
+	* Temporary name of a link, in the same folder as the file it replaces
+	* @return name, to be deleted by the caller
+	*/
+	static LPWSTR getTempName(LPCWSTR name, DWORD number) {
+		wchar_t suffix[24];
+		wsprintf(suffix, L".%u.dfhl", number);
+		LPWSTR temp = new wchar_t[wcslen(name) + wcslen(suffix) + 1];
+		wcscpy(temp, name);
+		wcscat(temp, suffix);
+		return temp;
+	}
+
+	/**
+	* Adds the intent to replace a file by a link, the next sequence number is assigned
+	* @param name Name of the file to be replaced by the link
+	*/
+	void addIntent(LPCWSTR name) {
+		wchar_t number[16];
+		wsprintf(number, L"%u", ++sequence);
+		LPWSTR temp = getTempName(name, sequence);
+		append(L"L\t");
+		append(number);
+		append(L"\t");
+		append(temp);
+		append(L"\t");
+		append(name);
+		append(L"\r\n");
+		delete[] temp;
+	}
+
+	DWORD getSequence() {
+		return sequence;
+	}
+
+	/**
+	* Writes all intents added, they are on disk before any of the links is created
+	*/
+	bool commit() {
+		return write(true);
+	}
+
+	/**
+	* Marks all intents written as done. Not flushed, if the mark gets lost the
+	* recovery just doesn't find the temporary names.
+	*/
+	bool markDone() {
+		wchar_t number[16];
+		wsprintf(number, L"%u", sequence);
+		append(L"D\t");
+		append(number);
+		append(L"\r\n");
+		return write(false);
+	}
+
+	/**
+	* Closes the journal, it's removed when all links are done
+	*/
+	void close() {
+		if (hFile != INVALID_HANDLE_VALUE) {
+			CloseHandle(hFile);
+			hFile = INVALID_HANDLE_VALUE;
+			DeleteFile(fileName);
+		}
+	}
+
+	/**
+	* Completes the links left incomplete by a crash. The temporary name of a
+	* link already renamed over its file does not exist any more. If the file
+	* is missing, the link is renamed to it, otherwise the temporary name is
+	* removed and the file stays as it was.
+	* @return number of links completed or rolled back, -1 on error
+	*/
+	static int recover(LPCWSTR fileName) {
+		HANDLE hJournal = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hJournal == INVALID_HANDLE_VALUE) {
+			logError(L"Unable to open journal \"%s\": %i", fileName, GetLastError());
+			return -1;
+		}
+		DWORD size = GetFileSize(hJournal, NULL);
+		LPWSTR text = new wchar_t[size / sizeof(wchar_t) + 1];
+		DWORD read;
+		if (!ReadFile(hJournal, text, size, &read, NULL)) {
+			logError(L"Unable to read journal \"%s\": %i", fileName, GetLastError());
+			CloseHandle(hJournal);
+			delete[] text;
+			return -1;
+		}
+		CloseHandle(hJournal);
+		text[read / sizeof(wchar_t)] = 0;
+
+		// find the last batch done, records torn by the crash have no line end
+		DWORD done = 0;
+		for (LPWSTR line = text, end; (end = wcschr(line, L'\n')) != NULL; line = end + 1) {
+			if (line[0] == L'D' && line[1] == L'\t') {
+				DWORD value = (DWORD)wcstoul(line + 2, NULL, 10);
+				done = value > done ? value : done;
+			}
+		}
+
+		int recovered = 0;
+		bool failed = false;
+		LPWSTR next = text;
+		while (next != NULL && *next != 0) {
+			LPWSTR line = next;
+			next = wcschr(line, L'\n');
+			if (next == NULL) {
+				break;
+			}
+			if (next > line && next[-1] == L'\r') {
+				next[-1] = 0;
+			}
+			*next++ = 0;
+			LPWSTR type = nextField(line);
+			LPWSTR number = nextField(line);
+			LPWSTR temp = nextField(line);
+			LPWSTR name = nextField(line);
+			if (name == NULL || wcscmp(type, L"L") != 0 || (DWORD)wcstoul(number, NULL, 10) <= done) {
+				continue;
+			}
+			if (GetFileAttributes(temp) == INVALID_FILE_ATTRIBUTES) {
+				continue;
+			}
+			if (GetFileAttributes(name) == INVALID_FILE_ATTRIBUTES) {
+				logInfo(L"Completing link %s", name);
+				if (!MoveFile(temp, name)) {
+					logError(L"Unable to rename \"%s\": %i", temp, GetLastError());
+					failed = true;
+					continue;
+				}
+			} else {
+				logInfo(L"Rolling back link %s", name);
+				if (!DeleteFile(temp)) {
+					logError(L"Unable to delete \"%s\": %i", temp, GetLastError());
+					failed = true;
+					continue;
+				}
+			}
+			recovered++;
+		}
+		delete[] text;
+
+		// keep the journal for another try if not all links could be recovered
+		if (failed) {
+			return -1;
+		}
+		if (!DeleteFile(fileName)) {
+			logError(L"Unable to delete journal \"%s\": %i", fileName, GetLastError());
+		}
+		return recovered;
+	}
+
+	Journal() {
+		hFile = INVALID_HANDLE_VALUE;
+		fileName = NULL;
+		sequence = 0;
+		pending = NULL;
+		pendingLength = pendingCapacity = 0;
+	}
+
+	~Journal() {
+		if (hFile != INVALID_HANDLE_VALUE) {
+			CloseHandle(hFile);
+		}
+		delete[] fileName;
+		delete[] pending;
+	}
+};
+
+/**
+* Duplicate File Linker Class
 */
 class DuplicateFileHardLinker {
 
 private:
 	/** Collection of paths to process */
 	Paths* p;
-	/** Collection of files to check */
+	/** Tree of all folders the files were found in */
+	Folders* folders;
+	/** Table of files to check */
 	Files* f;
 	/** List of duplicates to process */
 	Duplicates* d;
-	/** buffer variables for file compare */
-	LPBYTE block1;
-	LPBYTE block2;
 	/** Flag if attributes of file need to match */
 	bool attributeMustMatch;
 	/** Flag if hidden files should be processed */
@@ -438,274 +5266,1570 @@ private:
 	bool systemFiles;
 	/** Flag if timestamps of file need to match */
 	bool dateTimeMustMatch;
+	/** File name of the persistent hash index, NULL if not used */
+	LPWSTR indexFile;
+	/** Policy choosing the file all equal files are linked to */
+	TargetPolicy targetPolicy;
+	/** Folder the target should be below with PREFERRED_ROOT */
+	LPWSTR preferredRoot;
+	/** Flag if duplicates share their clusters (block cloning) instead of being hard linked */
+	bool cloneFiles;
+	/** Bytes cloned with one call */
+	DWORD cloneBatchSize;
+	/** File name of the journal of the link phase */
+	LPWSTR journalFile;
+	/** Number of threads linking folders in parallel */
+	int linkThreads;
+	/** Folders linked at once per file system, like "NTFS=8,ReFS=16", NULL for no limit */
+	LPWSTR linkLimits;
+	/** Folder the synthetic tree of the link benchmark is created in */
+	LPWSTR benchmarkFolder;
+	/** Bytes the file table may take before it's spilled to sorted runs, 0 for no limit */
+	size_t memoryLimit;
+	/** Runs of the file table while walking with a memory limit, NULL otherwise */
+	FileRuns* runs;
+	/** Flag if groups and the reads within a group are ordered by the physical location of the files */
+	bool physicalOrder;
+	/** Bytes of the unbuffered read buffers of all compare threads */
+	size_t bufferBudget;
+	/** Limits of the reads and metadata operations, NULL if not limited */
+	Throttle* throttle;
+	/** First cluster of each file of the size groups while comparing in physical order, NULL otherwise */
+	INT64* locations;
+	/** Order the size groups are compared in, NULL for size order */
+	int* groupOrder;
+
+	/**
+	* Layout of DUPLICATE_EXTENTS_DATA, missing in older SDKs
+	*/
+	struct DuplicateExtentsData {
+		HANDLE FileHandle;
+		INT64 SourceFileOffset;
+		INT64 TargetFileOffset;
+		INT64 ByteCount;
+	};
+	/** Number of threads walking the directory tree */
+	int threadCount;
+	/** Number of reads in flight per file while comparing */
+	int readAhead;
+	/** Files up to this size are compared memory mapped, -1 for all files */
+	INT64 mapThreshold;
+
+	/**
+	* Open handle of a folder, its subfolders are opened relative to it
+	*/
+	class FolderHandle {
+	public:
+		HANDLE handle;
+		/** Subfolders waiting to be parsed, plus one while the folder itself is parsed */
+		volatile LONG references;
+	};
+
+	/**
+	* Folder waiting to be parsed
+	*/
+	class FolderItem {
+	public:
+		DWORD id;
+		/** Name relative to the parent handle, the full path if there is no parent handle */
+		LPWSTR name;
+		/** Handle of the parent folder, NULL for the paths to process or without the native API */
+		FolderHandle* parent;
+		/** Handle of the folder while it's parsed, NULL if the subfolders are given by their full path */
+		FolderHandle* handle;
+	};
+
+	/**
+	* State of one thread walking the directory tree
+	*/
+	class Walker {
+	public:
+		DuplicateFileHardLinker* owner;
+		int id;
+		/** Folders still to be parsed, other walkers steal from here when idle */
+		WorkQueue queue;
+		/** Files found by this walker */
+		Files files;
+		int folders;
+		/** Entries of all folders parsed, including the ones skipped */
+		INT64 items;
+		/** Buffer for the folder entries, INT64 for their alignment */
+		INT64* entries;
+		/** Volume checked last for stable file ids and the result */
+		DWORD checkedVolume;
+		bool checkedStable;
+		/** Flag if the file ids of the folder being parsed identify its files */
+		bool stableIds;
+
+		Walker() {
+			entries = new INT64[DIRECTORY_BUFFER_SIZE / sizeof(INT64)];
+			checkedVolume = 0;
+			checkedStable = false;
+			stableIds = false;
+		}
+
+		~Walker() {
+			delete[] entries;
+		}
+	};
+
+	/**
+	* Layout of FILE_ID_BOTH_DIR_INFO, missing in older SDKs
+	*/
+	struct DirectoryEntry {
+		DWORD NextEntryOffset;
+		DWORD FileIndex;
+		INT64 CreationTime;
+		INT64 LastAccessTime;
+		INT64 LastWriteTime;
+		INT64 ChangeTime;
+		INT64 EndOfFile;
+		INT64 AllocationSize;
+		DWORD FileAttributes;
+		DWORD FileNameLength;
+		DWORD EaSize;
+		CHAR ShortNameLength;
+		WCHAR ShortName[12];
+		INT64 FileId;
+		WCHAR FileName[1];
+	};
+	enum {
+		FILE_ID_BOTH_DIRECTORY_INFO = 10,
+		FILE_ID_BOTH_DIRECTORY_RESTART_INFO = 11,
+		REMOTE_PROTOCOL_INFO = 13
+	};
+	/** FILE_SUPPORTS_OPEN_BY_FILE_ID, missing in older SDKs */
+	static const DWORD VOLUME_OPENS_BY_FILE_ID = 0x01000000;
+
+	/**
+	* Layout of FILE_ID_FULL_DIR_INFORMATION, the short name is not looked up
+	*/
+	struct FullDirectoryEntry {
+		DWORD NextEntryOffset;
+		DWORD FileIndex;
+		INT64 CreationTime;
+		INT64 LastAccessTime;
+		INT64 LastWriteTime;
+		INT64 ChangeTime;
+		INT64 EndOfFile;
+		INT64 AllocationSize;
+		DWORD FileAttributes;
+		DWORD FileNameLength;
+		DWORD EaSize;
+		INT64 FileId;
+		WCHAR FileName[1];
+	};
+	/** Method the folders are read with */
+	EnumerationMethod enumeration;
+	/** Entries of all folders of the last walk */
+	INT64 walkedItems;
+	typedef BOOL (WINAPI *GetFileInformationByHandleExProc)(HANDLE hFile, int FileInformationClass, LPVOID lpFileInformation, DWORD dwBufferSize);
+	/** GetFileInformationByHandleEx, available since Windows Vista */
+	GetFileInformationByHandleExProc getFileInformationByHandleEx;
+	typedef BOOL (WINAPI *GetVolumeInformationByHandleProc)(HANDLE hFile, LPWSTR lpVolumeNameBuffer, DWORD nVolumeNameSize, LPDWORD lpVolumeSerialNumber,
+		LPDWORD lpMaximumComponentLength, LPDWORD lpFileSystemFlags, LPWSTR lpFileSystemNameBuffer, DWORD nFileSystemNameSize);
+	/** GetVolumeInformationByHandleW, available since Windows Vista */
+	GetVolumeInformationByHandleProc getVolumeInformationByHandle;
+
+	/** Layout of PERFORMANCE_INFORMATION, to avoid the dependency on psapi.h */
+	struct PerformanceInformation {
+		DWORD cb;
+		SIZE_T CommitTotal;
+		SIZE_T CommitLimit;
+		SIZE_T CommitPeak;
+		SIZE_T PhysicalTotal;
+		SIZE_T PhysicalAvailable;
+		SIZE_T SystemCache;
+		SIZE_T KernelTotal;
+		SIZE_T KernelPaged;
+		SIZE_T KernelNonpaged;
+		SIZE_T PageSize;
+		DWORD HandleCount;
+		DWORD ProcessCount;
+		DWORD ThreadCount;
+	};
+	typedef BOOL (WINAPI *GetPerformanceInfoProc)(PerformanceInformation* pPerformanceInformation, DWORD cb);
+	/** GetPerformanceInfo, in kernel32 since Windows 7 and in psapi before */
+	GetPerformanceInfoProc getPerformanceInfo;
+	/** Flag if the compare should leave the file cache of other processes alone */
+	bool cacheNeutral;
+	/** Content hash the files are grouped by, NO_HASH for the byte compare */
+	HashMethod hashMethod;
+	/** Flag if the files are compared byte by byte besides the hash */
+	bool verifyHash;
+	/** Files up to this size are read whole in one batch per group, 0 for none */
+	INT64 batchLimit;
+	Walker* walkers;
+	/** Next candidate group to be compared */
+	volatile LONG nextGroup;
+	/** Duplicates found per group, merged in group order when all groups are compared */
+	Duplicates** groupResults;
+	/** Number of folders queued or being parsed by any walker */
+	volatile LONG pendingFolders;
+	/** Number of walkers waiting for folders to be queued */
+	volatile LONG idleWalkers;
+	/** Released for a folder queued while walkers wait, and for all of them when the walk ends */
+	HANDLE foldersQueued;
+	/** First error stopping the walk, NULL if none */
+	LPWSTR walkError;
+	CRITICAL_SECTION walkLock;
+	/** First error stopping the compare workers, NULL if none */
+	LPCWSTR compareError;
+	CRITICAL_SECTION compareLock;
+
+	/**
+	* Replacement of one name by a link to its target
+	*/
+	class LinkOperation {
+	public:
+		/** Index of the group in the batch */
+		int group;
+		LPCWSTR target;
+		LPCWSTR name;
+		/** Length of the folder part of the name, including the backslash */
+		size_t folderLength;
+		/** Journal sequence number, part of the temporary name */
+		DWORD sequence;
+		bool failed;
+	};
+
+	/**
+	* Volume links are created on, the semaphore limits the folders linked at once
+	*/
+	class LinkVolume {
+	public:
+		LPWSTR path;
+		/** NULL if not limited */
+		HANDLE semaphore;
+	};
+	/** Operations of the batch being linked, sorted by folder */
+	LinkOperation* linkOperations;
+	/** Start of each run of operations in one folder, followed by the end of the last one */
+	int* linkRuns;
+	/** Index of the volume of each run, -1 if unknown */
+	int* linkRunVolumes;
+	int linkRunCount;
+	/** Next run to be linked */
+	volatile LONG nextLinkRun;
+	LinkVolume* linkVolumes;
+	int linkVolumeCount;
+	/** Names linked so far */
+	int linkCount;
+
+	/**
+	* Logs a found file to debug
+	*/
+	void logFile(const WIN32_FIND_DATA& FileData) {
+		INT64 size = FileData.nFileSizeLow + ((INT64)MAXDWORD + 1) * FileData.nFileSizeHigh;
+		logDebug(L"Found file \"%s\" (Size=%I64i,%s%s%s%s%s%s%s%s%s%s%s%s)", 
+			FileData.cFileName,
+			size,
+			FILE_ATTRIBUTE_ARCHIVE      &FileData.dwFileAttributes?L"ARCHIVE ":L"",
+			FILE_ATTRIBUTE_COMPRESSED   &FileData.dwFileAttributes?L"COMPRESSED ":L"",
+			FILE_ATTRIBUTE_DIRECTORY    &FileData.dwFileAttributes?L"DIRECTORY ":L"",
+			FILE_ATTRIBUTE_ENCRYPTED    &FileData.dwFileAttributes?L"ENCRYPTED ":L"",
+			FILE_ATTRIBUTE_HIDDEN       &FileData.dwFileAttributes?L"HIDDEN ":L"",
+			FILE_ATTRIBUTE_NORMAL       &FileData.dwFileAttributes?L"NORMAL ":L"",
+			FILE_ATTRIBUTE_OFFLINE      &FileData.dwFileAttributes?L"OFFLINE ":L"",
+			FILE_ATTRIBUTE_READONLY     &FileData.dwFileAttributes?L"READONLY ":L"",
+			FILE_ATTRIBUTE_REPARSE_POINT&FileData.dwFileAttributes?L"REPARSE_POINT ":L"",
+			FILE_ATTRIBUTE_SPARSE_FILE  &FileData.dwFileAttributes?L"SPARSE ":L"",
+			FILE_ATTRIBUTE_SYSTEM       &FileData.dwFileAttributes?L"SYSTEM ":L"",
+			FILE_ATTRIBUTE_TEMPORARY    &FileData.dwFileAttributes?L"TEMP ":L"");
+	}
+
+	/**
+	* Adds a file to the collection of files to process
+	* @param file FindFile Structure of further file information
+	*/
+	void addFile(Walker& w, FolderItem& folder, const WIN32_FIND_DATA& details, INT64 fileId) {
+		w.files.add(folder.id, details.cFileName,
+			details.nFileSizeLow + ((INT64)MAXDWORD + 1) * details.nFileSizeHigh,
+			details.ftLastWriteTime.dwLowDateTime + ((INT64)MAXDWORD + 1) * details.ftLastWriteTime.dwHighDateTime,
+			fileId);
+		if (runs != NULL && w.files.getMemoryUsage() > runs->getTableLimit() && !runs->write(&w.files)) {
+			setWalkError(L"Run file", GetLastError());
+		}
+	}
+
+	/**
+	* Adds a folder to the tree and queues it to be parsed by the given walker
+	* @param parent Id of the parent folder, NO_FOLDER for the paths to process
+	* @param name Name of the folder
+	* @param openName Name the folder is opened by, taken over by the queue
+	* @param parentHandle Handle openName is relative to, NULL for a full path
+	*/
+	void addFolder(Walker& w, DWORD parent, LPCWSTR name, LPWSTR openName, FolderHandle* parentHandle) {
+		FolderItem* folder = new FolderItem();
+		folder->id = folders->add(parent, name);
+		folder->name = openName;
+		folder->parent = parentHandle;
+		folder->handle = NULL;
+		if (parentHandle != NULL) {
+			InterlockedIncrement(&parentHandle->references);
+		}
+		InterlockedIncrement(&pendingFolders);
+		w.queue.pushBack(folder);
+		if (idleWalkers > 0) {
+			ReleaseSemaphore(foldersQueued, 1, NULL);
+		}
+	}
+
+	/**
+	* Drops a reference to the folder handle, it's closed with the last one
+	*/
+	void releaseFolderHandle(FolderHandle* handle) {
+		if (handle != NULL && InterlockedDecrement(&handle->references) == 0) {
+			CloseHandle(handle->handle);
+			delete handle;
+		}
+	}
+
+	void deleteFolder(FolderItem* folder) {
+		releaseFolderHandle(folder->parent);
+		delete[] folder->name;
+		delete folder;
+	}
+
+	/**
+	* Adds a found entry in the file system into the collection iof items to be processed
+	* This function also applies all selected filters of the user
+	* @param item FindFile Structure of further file information
+	* @param fileId File index on the volume, 0 if not known
+	*/
+	void addItem(Walker& w, FolderItem& folder, const WIN32_FIND_DATA& item, INT64 fileId) {
+		w.items++;
+
+		// check if this is a valid file and not a dummy like "." or ".."
+		if (wcscmp(item.cFileName, L".") == 0 || wcscmp(item.cFileName, L"..") == 0) {
+			// just ignore these entries
+			return;
+		}
+
+		logFile(item);
+
+		// check if it's a directory entry...
+		if (item.dwFileAttributes&FILE_ATTRIBUTE_DIRECTORY) {
+
+			// check for recursice setting
+			if (!recursive) {
+				logDebug(L"skipping folder, not running recursive");
+				return;
+			}
+
+			// check for junction
+			if (!followJunctions && item.dwFileAttributes&FILE_ATTRIBUTE_REPARSE_POINT) {
+				logDebug(L"ignoring junction");
+				return;
+			}
+
+			// add the folder to the collection, opened relative to this one if possible
+			if (folder.handle != NULL) {
+				LPWSTR name = new wchar_t[wcslen(item.cFileName) + 1];
+				wcscpy(name, item.cFileName);
+				addFolder(w, folder.id, item.cFileName, name, folder.handle);
+			} else {
+				LPWSTR fullPath = new wchar_t[wcslen(folder.name) + wcslen(item.cFileName) + 2];
+				wcscpy(fullPath, folder.name);
+				wcscat(fullPath, L"\\");
+				wcscat(fullPath, item.cFileName);
+				addFolder(w, folder.id, item.cFileName, fullPath, NULL);
+			}
+
+		} else {
+
+			// check if this is a hidden file
+			if (!hiddenFiles && item.dwFileAttributes&FILE_ATTRIBUTE_HIDDEN) {
+				logDebug(L"ignoring file, hidden attribute is set");
+				return;
+			}
+
+			// check if the file is "big" enough
+			if (!smallFiles && (item.nFileSizeLow > 0) && (item.nFileSizeLow < MIN_FILE_SIZE) && (item.nFileSizeHigh == 0)) {
+				logDebug(L"ignoring file, is too small.");
+				return;
+			}
+
+			// check if this is a system file
+			if (!systemFiles && (item.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM)) {
+				logDebug(L"ignoring file, system attribute is set");
+				return;
+			}
+
+			// add the file only if it contains data!
+			if ((item.nFileSizeLow > 0) || (item.nFileSizeHigh > 0)) {
+				addFile(w, folder, item, fileId);
+			}
+		}
+	}
+
+	/**
+	* Parses the content of one folder
+	*/
+	void parseFolder(Walker& w, FolderItem& folder) {
+		if (logLevel <= LOG_VERBOSE) {
+			LPWSTR path = folders->getPath(folder.id);
+			logVerbose(L"Parsing Folder %s", path);
+			delete[] path;
+		}
+		if (enumeration != FIND_FILES && parseFolderById(w, folder)) {
+			return;
+		}
+		if (folder.parent != NULL) {
+			// read by the full path instead, the files below must not drop out of the run
+			LPWSTR path = folders->getPath(folder.id);
+			logDebug(L"Unable to read folder \"%s\" relative to its parent, reading it by its path.", path);
+			delete[] folder.name;
+			folder.name = path;
+			releaseFolderHandle(folder.parent);
+			folder.parent = NULL;
+		}
+
+		WIN32_FIND_DATA FindFileData;
+		HANDLE hFind = INVALID_HANDLE_VALUE;
+		wchar_t DirSpec[MAX_PATH_LENGTH];  // directory specification
+		DWORD dwError;
+
+		size_t len = wcslen(wcsncpy(DirSpec, folder.name, wcslen(folder.name)+1));
+		// Do not append backslash if this is already the last character!
+		if(DirSpec[len] != L'\\')
+			wcsncat(DirSpec, L"\\", 2);
+		wcsncat(DirSpec, L"*", 2);
+
+		hFind = FindFirstFile(DirSpec, &FindFileData);
+
+		if (hFind == INVALID_HANDLE_VALUE) {
+			// Accessing "<drive>:\System Volume Information\*" gives an
+			// ERROR_ACCESS_DENIED. So this has to be fixed to scan whole
+			// volumes! Also can happen on folders with no access permissions.
+			logError(GetLastError(), L"Unable to read folder content of \"%s\".", folder.name);
+		} else {
+			addItem(w, folder, FindFileData, 0);
+			while (FindNextFile(hFind, &FindFileData) != 0) {
+				addItem(w, folder, FindFileData, 0);
+			}
+
+			dwError = GetLastError();
+			FindClose(hFind);
+			if (dwError != ERROR_NO_MORE_FILES) {
+				setWalkError(L"FindNextFile", dwError);
+			}
+		}
+	}
+
+	/**
+	* Adds the entries of a buffer filled by a directory query, the layouts
+	* of the information classes differ but use the same field names
+	*/
+	template <class Entry> void addEntries(Walker& w, FolderItem& folder, Entry* entry) {
+		while (true) {
+			// empty files are never added, they are skipped before any conversion unless logged
+			if (entry->EndOfFile == 0 && !(entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && logLevel > LOG_DEBUG) {
+				w.items++;
+			} else {
+				// only the fields used by addItem are set
+				WIN32_FIND_DATA item;
+				item.dwFileAttributes = entry->FileAttributes;
+				item.nFileSizeLow = (DWORD)entry->EndOfFile;
+				item.nFileSizeHigh = (DWORD)(entry->EndOfFile >> 32);
+				item.ftLastWriteTime.dwLowDateTime = (DWORD)entry->LastWriteTime;
+				item.ftLastWriteTime.dwHighDateTime = (DWORD)(entry->LastWriteTime >> 32);
+				size_t nameLength = entry->FileNameLength / sizeof(WCHAR);
+				if (nameLength >= MAX_PATH) {
+					nameLength = MAX_PATH - 1;
+				}
+				wcsncpy(item.cFileName, entry->FileName, nameLength);
+				item.cFileName[nameLength] = 0;
+				addItem(w, folder, item, w.stableIds ? entry->FileId : 0);
+			}
+			if (entry->NextEntryOffset == 0) {
+				break;
+			}
+			entry = (Entry*)((LPBYTE)entry + entry->NextEntryOffset);
+		}
+	}
+
+	/**
+	* Checks if the file ids of the volume of the folder identify its files.
+	* Only local NTFS and ReFS volumes which open files by id guarantee this,
+	* redirectors and other file systems may report ids made up or reused.
+	*/
+	bool hasStableFileIds(HANDLE hFolder) {
+		if (getVolumeInformationByHandle == NULL || getFileInformationByHandleEx == NULL) {
+			return false;
+		}
+		// only files of network shares have remote protocol information
+		INT64 remoteInfo[32];
+		if (getFileInformationByHandleEx(hFolder, REMOTE_PROTOCOL_INFO, remoteInfo, sizeof(remoteInfo))) {
+			return false;
+		}
+		wchar_t fileSystem[MAX_PATH];
+		DWORD flags;
+		if (!getVolumeInformationByHandle(hFolder, NULL, 0, NULL, NULL, &flags, fileSystem, MAX_PATH)) {
+			return false;
+		}
+		return (flags & VOLUME_OPENS_BY_FILE_ID) && (wcscmp(fileSystem, L"NTFS") == 0 || wcscmp(fileSystem, L"ReFS") == 0);
+	}
+
+	/**
+	* Parses the content of one folder through its handle, which also gives
+	* the volume and the file index of each entry without opening the files.
+	* The folder is opened relative to its parent, the handle is kept for
+	* the subfolders found.
+	* @return boolean value if the folder could be opened and listed, false to read it with FindFirstFile
+	*/
+	bool parseFolderById(Walker& w, FolderItem& folder) {
+		HANDLE hFolder;
+		if (folder.parent != NULL) {
+			hFolder = openRelative(folder.parent->handle, folder.name, FILE_LIST_DIRECTORY | FILE_TRAVERSE | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+				NT_FILE_DIRECTORY_FILE | NT_FILE_SYNCHRONOUS_IO_NONALERT | NT_FILE_OPEN_FOR_BACKUP_INTENT);
+		} else {
+			hFolder = CreateFile(folder.name, FILE_LIST_DIRECTORY | FILE_TRAVERSE | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		}
+		if (hFolder == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		if (ntOpenFile != NULL) {
+			folder.handle = new FolderHandle();
+			folder.handle->handle = hFolder;
+			folder.handle->references = 1;
+		}
+		BY_HANDLE_FILE_INFORMATION info;
+		w.stableIds = false;
+		if (GetFileInformationByHandle(hFolder, &info)) {
+			folders->setVolume(folder.id, info.dwVolumeSerialNumber);
+			if (info.dwVolumeSerialNumber != w.checkedVolume) {
+				w.checkedVolume = info.dwVolumeSerialNumber;
+				w.checkedStable = hasStableFileIds(hFolder);
+			}
+			w.stableIds = info.dwVolumeSerialNumber != 0 && w.checkedStable;
+		}
+
+		DWORD error = ERROR_NO_MORE_FILES;
+		bool listed = false;
+		if (enumeration == FILE_ID_FULL_INFO) {
+			NtIoStatusBlock status;
+			BOOLEAN restart = TRUE;
+			LONG result;
+			while ((result = ntQueryDirectoryFile(hFolder, NULL, NULL, NULL, &status, w.entries, DIRECTORY_BUFFER_SIZE, NT_FILE_ID_FULL_DIRECTORY_INFORMATION, FALSE, NULL, restart)) >= 0) {
+				restart = FALSE;
+				listed = true;
+				addEntries(w, folder, (FullDirectoryEntry*)w.entries);
+			}
+			if (result != NT_STATUS_NO_MORE_FILES && result != NT_STATUS_NO_SUCH_FILE) {
+				error = rtlNtStatusToDosError != NULL ? rtlNtStatusToDosError(result) : (DWORD)result;
+			}
+		} else {
+			int infoClass = FILE_ID_BOTH_DIRECTORY_RESTART_INFO;
+			while (getFileInformationByHandleEx(hFolder, infoClass, w.entries, DIRECTORY_BUFFER_SIZE)) {
+				infoClass = FILE_ID_BOTH_DIRECTORY_INFO;
+				listed = true;
+				addEntries(w, folder, (DirectoryEntry*)w.entries);
+			}
+			error = GetLastError();
+		}
+		if (folder.handle != NULL) {
+			releaseFolderHandle(folder.handle);
+			folder.handle = NULL;
+		} else {
+			CloseHandle(hFolder);
+		}
+
+		// file systems and servers without the information class are read with FindFirstFile
+		if (error != ERROR_NO_MORE_FILES && !listed) {
+			logDebug(L"Listing the folder by handle failed with error %u, reading it with FindFirstFile.", error);
+			return false;
+		}
+		if (error != ERROR_NO_MORE_FILES) {
+			setWalkError(enumeration == FILE_ID_FULL_INFO ? L"NtQueryDirectoryFile" : L"GetFileInformationByHandleEx", error);
+		}
+		return true;
+	}
+
+	/**
+	* Remembers the first error stopping the walk. It can't be thrown across
+	* threads, it's thrown after all walkers stopped.
+	*/
+	void setWalkError(LPCWSTR function, DWORD error) {
+		EnterCriticalSection(&walkLock);
+		if (walkError == NULL) {
+			walkError = new wchar_t[TEMP_BUFFER_LENGTH];
+			wsprintf(walkError, L"%s error. Error is %u\n", function, error);
+			ReleaseSemaphore(foldersQueued, threadCount, NULL);
+		}
+		LeaveCriticalSection(&walkLock);
+	}
+
+	/**
+	* Takes the next folder from the own queue, or from the other walkers' queues
+	* @return folder to parse, NULL if all queues are empty
+	*/
+	FolderItem* popFolder(Walker& w) {
+		FolderItem* folder = (FolderItem*)w.queue.popBack();
+		for (int k = 1; k < threadCount && folder == NULL; k++) {
+			folder = (FolderItem*)walkers[(w.id + k) % threadCount].queue.popFront();
+		}
+		return folder;
+	}
+
+	/**
+	* Parses folders until the whole tree is done. Folders are taken from the
+	* own queue first (depth first), if empty from the other walkers' queues.
+	*/
+	void walk(Walker& w) {
+		while (walkError == NULL) {
+			FolderItem* folder = popFolder(w);
+			if (folder == NULL) {
+				// the queues are searched again after signing up, a folder queued before is found then
+				InterlockedIncrement(&idleWalkers);
+				folder = popFolder(w);
+				if (folder == NULL && pendingFolders > 0 && walkError == NULL) {
+					WaitForSingleObject(foldersQueued, INFINITE);
+				}
+				InterlockedDecrement(&idleWalkers);
+			}
+			if (folder == NULL) {
+				if (pendingFolders == 0) {
+					break;
+				}
+				continue;
+			}
+			parseFolder(w, *folder);
+			w.folders++;
+			deleteFolder(folder);
+			if (InterlockedDecrement(&pendingFolders) == 0) {
+				ReleaseSemaphore(foldersQueued, threadCount, NULL);
+			}
+		}
+	}
+
+	static unsigned __stdcall walkerThread(void* param) {
+		Walker* w = (Walker*)param;
+		w->owner->walk(*w);
+		return 0;
+	}
+
+	/**
+	* Compares candidate groups until all are done
+	*/
+	void compareGroups(GroupComparer* comparer, FolderCache* folderCache) {
+		LONG next;
+		while (compareError == NULL && (next = InterlockedIncrement(&nextGroup) - 1) < f->getGroupCount()) {
+			int group = groupOrder != NULL ? groupOrder[next] : next;
+			int members = f->getGroupMemberCount(group);
+			INT64 size = f->getGroupFileSize(group);
+			LPWSTR* names = new LPWSTR[members];
+			HANDLE* handles = NULL;
+			if (folderCache != NULL) {
+				folderCache->startGroup();
+				handles = new HANDLE[members];
+			}
+			for (int i = 0; i < members; i++) {
+				names[i] = f->getPath(f->getGroupMember(group, i));
+				if (handles != NULL) {
+					handles[i] = folderCache->get(f->getParent(f->getGroupMember(group, i)));
+				}
+			}
+			logVerbose(L"%i files have a size of %I64i, comparing...", members, size);
+			int* targets = new int[members];
+			ContentDigest* digests = new ContentDigest[members];
+			int* order = locations != NULL ? getReadOrder(group) : NULL;
+			if (comparer->compareGroup((LPCWSTR*)names, handles, members, size, targets, order, digests) > 0) {
+				groupResults[group] = collectDuplicates(group, targets, digests);
+			}
+			for (int i = 0; i < members; i++) {
+				delete[] names[i];
+			}
+			delete[] names;
+			delete[] handles;
+			delete[] targets;
+			delete[] digests;
+			delete[] order;
+		}
+	}
 
 	/**
-	* Logs a found file to debug
+	* Sort key of a file or a group by physical location
 	*/
-	void logFile(WIN32_FIND_DATA FileData) {
-		INT64 size = FileData.nFileSizeLow + ((INT64)MAXDWORD + 1) * FileData.nFileSizeHigh;
-		logDebug(L"Found file \"%s\" (Size=%I64i,%s%s%s%s%s%s%s%s%s%s%s%s)", 
-			FileData.cFileName,
-			size,
-			FILE_ATTRIBUTE_ARCHIVE      &FileData.dwFileAttributes?L"ARCHIVE ":L"",
-			FILE_ATTRIBUTE_COMPRESSED   &FileData.dwFileAttributes?L"COMPRESSED ":L"",
-			FILE_ATTRIBUTE_DIRECTORY    &FileData.dwFileAttributes?L"DIRECTORY ":L"",
-			FILE_ATTRIBUTE_ENCRYPTED    &FileData.dwFileAttributes?L"ENCRYPTED ":L"",
-			FILE_ATTRIBUTE_HIDDEN       &FileData.dwFileAttributes?L"HIDDEN ":L"",
-			FILE_ATTRIBUTE_NORMAL       &FileData.dwFileAttributes?L"NORMAL ":L"",
-			FILE_ATTRIBUTE_OFFLINE      &FileData.dwFileAttributes?L"OFFLINE ":L"",
-			FILE_ATTRIBUTE_READONLY     &FileData.dwFileAttributes?L"READONLY ":L"",
-			FILE_ATTRIBUTE_REPARSE_POINT&FileData.dwFileAttributes?L"REPARSE_POINT ":L"",
-			FILE_ATTRIBUTE_SPARSE_FILE  &FileData.dwFileAttributes?L"SPARSE ":L"",
-			FILE_ATTRIBUTE_SYSTEM       &FileData.dwFileAttributes?L"SYSTEM ":L"",
-			FILE_ATTRIBUTE_TEMPORARY    &FileData.dwFileAttributes?L"TEMP ":L"");
-	}
+	class LocationKey {
+	public:
+		DWORD volume;
+		INT64 location;
+		int index;
+	};
 
 	/**
-	* Compares the given 2 files content
+	* Orders by volume and first cluster, keys without location last, ties in index order
 	*/
-	CompareResult compareFiles(LPCWSTR file1, LPCWSTR file2, INT64 size) {
-		// doublecheck data consistency!
-		if (wcscmp(file1, file2) == 0) {
-			logError(L"Same file \"%s\"found as duplicate, ignoring!", file1);
-			return DIFFERENT;
+	static int __cdecl compareLocations(const void* key1, const void* key2) {
+		const LocationKey* k1 = (const LocationKey*)key1;
+		const LocationKey* k2 = (const LocationKey*)key2;
+		if ((k1->location == NO_LOCATION) != (k2->location == NO_LOCATION)) {
+			return k1->location == NO_LOCATION ? 1 : -1;
 		}
-
-		// Open File 1
-		HANDLE hFile1 = CreateFile(file1, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-		if (hFile1 == INVALID_HANDLE_VALUE) {
-			logError(L"Unable to open file \"%s\"", file1);
-			return DIFFERENT;
+		if (k1->location != NO_LOCATION) {
+			if (k1->volume != k2->volume) {
+				return k1->volume < k2->volume ? -1 : 1;
+			}
+			if (k1->location != k2->location) {
+				return k1->location < k2->location ? -1 : 1;
+			}
 		}
+		return k1->index < k2->index ? -1 : (k1->index > k2->index ? 1 : 0);
+	}
 
-		// Open File 2
-		HANDLE hFile2 = CreateFile(file2, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-		if (hFile2 == INVALID_HANDLE_VALUE) {
-			logError(L"Unable to open file \"%s\"", file2);
-			CloseHandle(hFile1);
-			return DIFFERENT;
+	/**
+	* First cluster of a file on its volume, taken from its retrieval pointers
+	* @param hFolder Folder of the file, INVALID_HANDLE_VALUE to open it by path
+	* @return logical cluster number, NO_LOCATION if the file has no clusters of its own
+	*/
+	INT64 getLocation(HANDLE hFolder, LPCWSTR path) {
+		HANDLE hFile;
+		if (hFolder != INVALID_HANDLE_VALUE) {
+			hFile = openRelative(hFolder, wcsrchr(path, L'\\') + 1, FILE_READ_ATTRIBUTES | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+				NT_FILE_NON_DIRECTORY_FILE | NT_FILE_SYNCHRONOUS_IO_NONALERT);
+		} else {
+			hFile = CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+		}
+		if (hFile == INVALID_HANDLE_VALUE) {
+			logDebug(L"Unable to open file \"%s\" to query its location.", path);
+			return NO_LOCATION;
 		}
 
-		// Check file system information details...
-		BY_HANDLE_FILE_INFORMATION info1;
-		BY_HANDLE_FILE_INFORMATION info2;
-		if (GetFileInformationByHandle(hFile1, &info1) && GetFileInformationByHandle(hFile2, &info2)) {
-			// First check if the files are already hard-linked...
-			if (info1.dwVolumeSerialNumber == info2.dwVolumeSerialNumber &&
-				info1.nFileIndexHigh == info2.nFileIndexHigh &&
-				info1.nFileIndexLow == info2.nFileIndexLow) {
+		// the first extent is enough, ERROR_MORE_DATA only tells that more follow. Files
+		// stored in their MFT record fail with ERROR_HANDLE_EOF, sparse extents have no LCN.
+		STARTING_VCN_INPUT_BUFFER input;
+		input.StartingVcn.QuadPart = 0;
+		RETRIEVAL_POINTERS_BUFFER extents;
+		DWORD bytes;
+		INT64 location = NO_LOCATION;
+		if ((DeviceIoControl(hFile, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input), &extents, sizeof(extents), &bytes, NULL) ||
+			GetLastError() == ERROR_MORE_DATA) && extents.ExtentCount > 0) {
+				location = extents.Extents[0].Lcn.QuadPart;
+		}
+		CloseHandle(hFile);
+		return location;
+	}
 
-					logVerbose(L"Files are already hard linked, skipping.");
-					CloseHandle(hFile1);
-					CloseHandle(hFile2);
-					return SAME;
+	/**
+	* Queries the location of the files of the size groups until all are done
+	*/
+	void locateFiles(FolderCache* folderCache) {
+		LONG group;
+		while ((group = InterlockedIncrement(&nextGroup) - 1) < f->getGroupCount()) {
+			if (folderCache != NULL) {
+				folderCache->startGroup();
 			}
-
-			// check for attributes matching
-			if (attributeMustMatch && info1.dwFileAttributes != info2.dwFileAttributes) {
-				logVerbose(L"Attributes of files do not match, skipping.");
-				CloseHandle(hFile1);
-				CloseHandle(hFile2);
-				return SKIP;
+			for (int i = 0; i < f->getGroupMemberCount(group); i++) {
+				int file = f->getGroupMember(group, i);
+				LPWSTR path = f->getPath(file);
+				HANDLE hFolder = folderCache != NULL ? folderCache->get(f->getParent(file)) : INVALID_HANDLE_VALUE;
+				throttleMetadata(1);
+				locations[file] = getLocation(hFolder, path);
+				delete[] path;
 			}
+		}
+	}
+
+	static unsigned __stdcall locateThread(void* param) {
+		CompareWorker* w = (CompareWorker*)param;
+		w->owner->locateFiles(w->folderCache);
+		return 0;
+	}
+
+	/**
+	* Members of a group ordered by their physical location
+	* @return member indices, to be deleted by the caller
+	*/
+	int* getReadOrder(int group) {
+		int members = f->getGroupMemberCount(group);
+		LocationKey* keys = new LocationKey[members];
+		for (int i = 0; i < members; i++) {
+			int file = f->getGroupMember(group, i);
+			keys[i].volume = folders->getVolume(f->getParent(file));
+			keys[i].location = locations[file];
+			keys[i].index = i;
+		}
+		qsort(keys, members, sizeof(LocationKey), compareLocations);
+		int* order = new int[members];
+		for (int i = 0; i < members; i++) {
+			order[i] = keys[i].index;
+		}
+		delete[] keys;
+		return order;
+	}
 
-			// check for time stamp matching
-			if (dateTimeMustMatch && (
-				info1.ftLastWriteTime.dwHighDateTime != info2.ftLastWriteTime.dwHighDateTime ||
-				info1.ftLastWriteTime.dwLowDateTime != info2.ftLastWriteTime.dwLowDateTime
-				)) {
-					logVerbose(L"Modification timestamps of files do not match, skipping.");
-					CloseHandle(hFile1);
-					CloseHandle(hFile2);
-					return SKIP;
+	/**
+	* Orders the size groups by the location of their first file, so that the
+	* groups on each volume are compared in one sweep over the disk
+	*/
+	void orderGroups() {
+		LocationKey* keys = new LocationKey[f->getGroupCount() > 0 ? f->getGroupCount() : 1];
+		for (int group = 0; group < f->getGroupCount(); group++) {
+			keys[group].volume = 0;
+			keys[group].location = NO_LOCATION;
+			keys[group].index = group;
+			for (int i = 0; i < f->getGroupMemberCount(group); i++) {
+				int file = f->getGroupMember(group, i);
+				LocationKey key;
+				key.volume = folders->getVolume(f->getParent(file));
+				key.location = locations[file];
+				key.index = group;
+				if (compareLocations(&key, &keys[group]) < 0) {
+					keys[group] = key;
+				}
 			}
-		} else {
-			logInfo(L"Unable to read further file information, skipping.");
-			CloseHandle(hFile1);
-			CloseHandle(hFile2);
-			return SKIP;
 		}
+		qsort(keys, f->getGroupCount(), sizeof(LocationKey), compareLocations);
+		groupOrder = new int[f->getGroupCount() > 0 ? f->getGroupCount() : 1];
+		for (int i = 0; i < f->getGroupCount(); i++) {
+			groupOrder[i] = keys[i].index;
+		}
+		delete[] keys;
+	}
 
-		// Read File Content and compare
-		if (block1 == NULL) {
-			block1 = new BYTE[BLOCK_SIZE];
-		}
-		if (block2 == NULL) {
-			block2 = new BYTE[BLOCK_SIZE];
-		}
-		DWORD blockSize = FIRST_BLOCK_SIZE; // Note: For the first block read smaller amount to speed up...
-		DWORD read1;
-		DWORD read2;
-		DWORD result1;
-		DWORD result2;
-		INT64 bytesToRead = size;
-		bool switcher = true; // helper variable for performance optimization
-		while (bytesToRead > 0) {
-
-			// Read Blocks - Performance boosted: read alternating to mimimize head shifts... ;-)
-			if (switcher) {
-				result1 = ReadFile(hFile1, block1, blockSize, &read1, NULL);
-				result2 = ReadFile(hFile2, block2, blockSize, &read2, NULL);
-			} else {
-				result2 = ReadFile(hFile2, block2, blockSize, &read2, NULL);
-				result1 = ReadFile(hFile1, block1, blockSize, &read1, NULL);
+	/**
+	* Estimates the head movement of comparing all groups, as the sum of the
+	* distances between the first clusters of the files read one after the
+	* other on each volume. The blocks of a group are read interleaved, so this
+	* is a lower bound for files larger than one block.
+	* @param ordered Flag to take groups and members in physical instead of table order
+	* @return distance in clusters
+	*/
+	INT64 getSeekDistance(bool ordered) {
+		int volumeCount = 0;
+		int capacity = 4;
+		DWORD* volumes = new DWORD[capacity];
+		INT64* heads = new INT64[capacity];
+		INT64 distance = 0;
+		for (int next = 0; next < f->getGroupCount(); next++) {
+			int group = ordered ? groupOrder[next] : next;
+			int* order = ordered ? getReadOrder(group) : NULL;
+			for (int i = 0; i < f->getGroupMemberCount(group); i++) {
+				int file = f->getGroupMember(group, order != NULL ? order[i] : i);
+				if (locations[file] == NO_LOCATION) {
+					continue;
+				}
+				DWORD volume = folders->getVolume(f->getParent(file));
+				int v = 0;
+				while (v < volumeCount && volumes[v] != volume) {
+					v++;
+				}
+				if (v == volumeCount) {
+					if (volumeCount == capacity) {
+						volumes = resizeArray(volumes, volumeCount, capacity * 2);
+						heads = resizeArray(heads, volumeCount, capacity * 2);
+						capacity *= 2;
+					}
+					volumes[v] = volume;
+					heads[v] = locations[file];
+					volumeCount++;
+				}
+				distance += locations[file] > heads[v] ? locations[file] - heads[v] : heads[v] - locations[file];
+				heads[v] = locations[file];
 			}
+			delete[] order;
+		}
+		delete[] volumes;
+		delete[] heads;
+		return distance;
+	}
 
-			// change the state for the next read operation
-			switcher = !switcher; // alternate read
-			blockSize = BLOCK_SIZE; // use bigger block size
+	/**
+	* Gets the volume and file index of a file
+	* @return boolean value if the file could be opened
+	*/
+	bool getIdentity(LPCWSTR path, BY_HANDLE_FILE_INFORMATION& info) {
+		throttleMetadata(1);
+		HANDLE hFile = CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		bool success = GetFileInformationByHandle(hFile, &info) != FALSE;
+		CloseHandle(hFile);
+		return success;
+	}
 
-			// Compare Data
-			bytesToRead -= read1;
-			if (read1 != read2 || read1 == 0) {
-				logError(L"File length differ or read error! This _should_ not happen!?!?");
-				CloseHandle(hFile2);
-				CloseHandle(hFile1);
-				return DIFFERENT;
+	/**
+	* Collects the files to be linked to each target of a group. Besides the
+	* files compared, all their other names found are linked to the target,
+	* the other names of the target are already linked.
+	* @param targets Member each file is to be linked to, as given by the compare
+	* @param digests Content hashes of the files, as given by the compare
+	*/
+	Duplicates* collectDuplicates(int group, int* targets, const ContentDigest* digests) {
+		int members = f->getGroupMemberCount(group);
+		Duplicates* results = new Duplicates();
+
+		// chain the files behind their target, keeping their order
+		int* nextMember = new int[members];
+		for (int i = 0; i < members; i++) {
+			nextMember[i] = -1;
+		}
+		for (int i = members - 1; i >= 0; i--) {
+			if (targets[i] >= 0 && targets[i] != i) {
+				nextMember[i] = nextMember[targets[i]];
+				nextMember[targets[i]] = i;
 			}
+		}
 
-			for (DWORD i = 0; i < read1; i++) {
-				if (block1[i] != block2[i]) {
-					logVerbose(L"Files differ in content.");
-					CloseHandle(hFile2);
-					CloseHandle(hFile1);
-					return DIFFERENT;
+		for (int target = 0; target < members; target++) {
+			if (targets[target] != target || nextMember[target] < 0) {
+				continue;
+			}
+			int count = 1;
+			int files = 0;
+			for (int i = nextMember[target]; i >= 0; i = nextMember[i]) {
+				count += f->getLinkCount(f->getGroupMember(group, i));
+				files++;
+			}
+			LPWSTR* paths = new LPWSTR[count];
+			int n = 0;
+			paths[n++] = f->getPath(f->getGroupMember(group, target));
+			for (int i = nextMember[target]; i >= 0; i = nextMember[i]) {
+				int file = f->getGroupMember(group, i);
+				paths[n++] = f->getPath(file);
+
+				// the other names were only compared by file id, they must be the file compared
+				BY_HANDLE_FILE_INFORMATION compared;
+				bool identified = f->getNextAlias(file) < 0 || getIdentity(paths[n - 1], compared);
+				for (int name = f->getNextAlias(file); name >= 0; name = f->getNextAlias(name)) {
+					LPWSTR path = f->getPath(name);
+					BY_HANDLE_FILE_INFORMATION info;
+					if (identified && getIdentity(path, info) && info.dwVolumeSerialNumber == compared.dwVolumeSerialNumber &&
+						info.nFileIndexHigh == compared.nFileIndexHigh && info.nFileIndexLow == compared.nFileIndexLow) {
+							paths[n++] = path;
+					} else {
+						logInfo(L"\"%s\" is not a hard link of \"%s\", skipping.", path, paths[n - 1]);
+						delete[] path;
+					}
 				}
 			}
+			results->add((LPCWSTR*)paths, n, files, f->getGroupFileSize(group), &digests[target]);
+			for (int i = 0; i < n; i++) {
+				delete[] paths[i];
+			}
+			delete[] paths;
 		}
+		delete[] nextMember;
+		return results;
+	}
 
-		// Close File 2
-		CloseHandle(hFile2);
+	/**
+	* Pairs a compare worker with its comparer
+	*/
+	class CompareWorker {
+	public:
+		DuplicateFileHardLinker* owner;
+		GroupComparer* comparer;
+		/** Folders of the files compared, NULL to open the files by name */
+		FolderCache* folderCache;
+	};
 
-		// Close File 1
-		CloseHandle(hFile1);
+	/**
+	* Remembers the first error stopping the compare. It can't be thrown across
+	* threads, the other workers stop taking groups and it's thrown after all
+	* of them stopped.
+	*/
+	void setCompareError(LPCWSTR error) {
+		EnterCriticalSection(&compareLock);
+		if (compareError == NULL) {
+			compareError = error;
+		}
+		LeaveCriticalSection(&compareLock);
+	}
 
-		logVerbose(L"Files are equal, hard link possible.");
-		return EQUAL;
+	static unsigned __stdcall compareThread(void* param) {
+		CompareWorker* w = (CompareWorker*)param;
+		try {
+			w->owner->compareGroups(w->comparer, w->folderCache);
+		} catch (LPCWSTR err) {
+			w->owner->setCompareError(err);
+		}
+		return 0;
 	}
 
 	/**
-	* Adds a file to the collection of files to process
-	* @param file FindFile Structure of further file information
+	* Logs the memory taken by the file table, in debug mode compared to a
+	* list with a separately allocated full path per file
 	*/
-	void addFile(LPCWSTR file, WIN32_FIND_DATA details) {
-		f->add(file, details.nFileSizeLow + ((INT64)MAXDWORD + 1) * details.nFileSizeHigh);
+	void logMemoryUsage() {
+		INT64 files = f->getSize();
+		if (files == 0) {
+			return;
+		}
+		INT64 bytes = f->getMemoryUsage() + folders->getMemoryUsage();
+		logVerbose(L"File table holds %I64i files in %i folders with %I64i KB, %I64i bytes per file", files, folders->getSize(), bytes / 1024, bytes / files);
+		if (logLevel <= LOG_DEBUG) {
+			// list item, size item and path string per file, each allocation with a heap header of two pointers
+			INT64 listBytes = files * (2 * sizeof(void*) + sizeof(void*) + sizeof(INT64) + 3 * 2 * sizeof(void*)) + f->getPathBytes();
+			logDebug(L"A list with full paths would take %I64i KB, %I64i bytes per file", listBytes / 1024, listBytes / files);
+		}
 	}
 
 	/**
-	* Compares the given 2 files content
+	* Walks through the directory tree with all walker threads and collects the files found
 	*/
-	void addDuplicate(LPCWSTR file1, LPCWSTR file2, INT64 size) {
-		d->add(file1, file2, size);
+	void walkTree() {
+		logInfo(L"Parsing Directory Tree...");
+		DWORD start = GetTickCount();
+		walkers = new Walker[threadCount];
+		pendingFolders = 0;
+		idleWalkers = 0;
+		foldersQueued = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+		if (foldersQueued == NULL) {
+			throw L"Unable to create walker semaphore.";
+		}
+		walkError = NULL;
+		InitializeCriticalSection(&walkLock);
+		LPWSTR folder = new wchar_t[MAX_PATH_LENGTH];
+		for (int i = 0; p->pop(folder); i++) {
+			LPWSTR path = new wchar_t[wcslen(folder) + 1];
+			wcscpy(path, folder);
+			addFolder(walkers[i % threadCount], NO_FOLDER, folder, path, NULL);
+		}
+		delete[] folder;
+
+		void** params = new void*[threadCount];
+		for (int i = 0; i < threadCount; i++) {
+			walkers[i].owner = this;
+			walkers[i].id = i;
+			walkers[i].folders = 0;
+			walkers[i].items = 0;
+			params[i] = &walkers[i];
+		}
+		runThreads(walkerThread, params, threadCount);
+		delete[] params;
+
+		int parsed = 0;
+		walkedItems = 0;
+		for (int i = 0; i < threadCount; i++) {
+			logDebug(L"Walker %i parsed %i folders", i, walkers[i].folders);
+			parsed += walkers[i].folders;
+			walkedItems += walkers[i].items;
+
+			// the order does not matter, the size index sorts the files
+			if (runs == NULL) {
+				f->merge(&walkers[i].files);
+			} else if (!runs->write(&walkers[i].files)) {
+				setWalkError(L"Run file", GetLastError());
+			}
+			FolderItem* remaining;
+			while ((remaining = (FolderItem*)walkers[i].queue.popBack()) != NULL) {
+				deleteFolder(remaining);
+			}
+		}
+		delete[] walkers;
+		walkers = NULL;
+		CloseHandle(foldersQueued);
+		foldersQueued = NULL;
+		DeleteCriticalSection(&walkLock);
+
+		DWORD time = GetTickCount() - start;
+		logVerbose(L"Parsed %i folders with %i threads in %ims, %I64i folders/s", parsed, threadCount, time, time>0?(INT64)parsed*1000 / time:0);
+		logVerbose(L"Read %I64i entries, %I64i entries/s", walkedItems, time>0?walkedItems*1000 / time:0);
+		logMemoryUsage();
+		if (walkError != NULL) {
+			throw (LPCWSTR)walkError;
+		}
 	}
 
 	/**
-	* Adds a found entry in the file system into the collection iof items to be processed
-	* This function also applies all selected filters of the user
-	* @param item FindFile Structure of further file information
+	* Links two files on hard disk. The link is created under a temporary name
+	* in the same folder and renamed over the second file, so its name always
+	* refers to either the old file or the link.
+	* @param file1 File name of the first file
+	* @param file2 File name of the second file to link to
+	* @param temp Temporary name of the link, journaled before
+	* @return boolean value if operation was successful
 	*/
-	void addItem(LPCWSTR base, WIN32_FIND_DATA item) {
-		// check if this is a valid file and not a dummy like "." or ".."
-		if (wcscmp(item.cFileName, L".") == 0 || wcscmp(item.cFileName, L"..") == 0) {
-			// just ignore these entries
-			return;
+	bool hardLinkFiles(LPCWSTR file1, LPCWSTR file2, LPCWSTR temp) {
+		logInfo(L"Linking %s and %s", file1, file2);
+
+		// Step 1: create hard link under the temporary name
+		if (!MyCreateHardLink(temp, file1, NULL)) {
+			logError(L"Unable to create hard link: %i", GetLastError());
+			return false;
 		}
 
-		logFile(item);
+		// Step 2: replace the file by the link, read only files can't be replaced
+		if (!MoveFileEx(temp, file2, MOVEFILE_REPLACE_EXISTING)) {
+			if (GetLastError() != ERROR_ACCESS_DENIED ||
+				!SetFileAttributes(file2, FILE_ATTRIBUTE_NORMAL) ||
+				!MoveFileEx(temp, file2, MOVEFILE_REPLACE_EXISTING)) {
 
-		// check if it's a directory entry...
-		LPWSTR fullPath = new wchar_t[MAX_PATH_LENGTH];
-		wsprintf(fullPath, L"%s\\%s", base, item.cFileName);
-		if (item.dwFileAttributes&FILE_ATTRIBUTE_DIRECTORY) {
+					logError(L"Unable to replace file by hard link: %i", GetLastError());
+					DeleteFile(temp);
+					return false;
+			}
+		}
 
-			// check for recursice setting
-			if (!recursive) {
-				logDebug(L"skipping folder, not running recursive");
-				delete fullPath;
-				return;
+		return true;
+	}
+
+	/**
+	* Opens the folder part of a name for operations relative to it
+	* @return handle of the folder, INVALID_HANDLE_VALUE if the native API is
+	* missing or the folder can't be opened
+	*/
+	HANDLE openLinkFolder(LPCWSTR name, size_t folderLength) {
+		if (ntSetInformationFile == NULL || ntOpenFile == NULL || folderLength == 0) {
+			return INVALID_HANDLE_VALUE;
+		}
+		LPWSTR folder = new wchar_t[folderLength + 1];
+		wcsncpy(folder, name, folderLength);
+		folder[folderLength] = 0;
+		HANDLE hFolder = CreateFile(folder, FILE_LIST_DIRECTORY | FILE_TRAVERSE | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		if (hFolder == INVALID_HANDLE_VALUE) {
+			logDebug(L"Unable to open folder \"%s\": %i", folder, GetLastError());
+		}
+		delete[] folder;
+		return hFolder;
+	}
+
+	/**
+	* Links a name to its target like hardLinkFiles, but the link is created
+	* and renamed relative to the open folder of the name, so the path is not
+	* parsed again for each step.
+	* @param hTarget Handle of the target file
+	* @param hFolder Handle of the folder of the name
+	* @return boolean value if operation was successful
+	*/
+	bool hardLinkRelative(HANDLE hTarget, HANDLE hFolder, const LinkOperation& op) {
+		logInfo(L"Linking %s and %s", op.target, op.name);
+		LPCWSTR leaf = op.name + op.folderLength;
+		LPWSTR temp = Journal::getTempName(leaf, op.sequence);
+
+		// Step 1: create hard link under the temporary name
+		LONG status = setNameRelative(hTarget, NT_FILE_LINK_INFORMATION, hFolder, temp, false);
+		if (status < 0) {
+			logError(L"Unable to create hard link: 0x%08X", status);
+			delete[] temp;
+			return false;
+		}
+
+		// Step 2: replace the file by the link, read only files can't be replaced
+		NtUnicodeString tempName;
+		NtObjectAttributes attributes;
+		initObjectAttributes(attributes, tempName, hFolder, temp);
+		NtIoStatusBlock ioStatus;
+		HANDLE hLink;
+		status = ntOpenFile(&hLink, DELETE | SYNCHRONIZE, &attributes, &ioStatus, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NT_FILE_SYNCHRONOUS_IO_NONALERT);
+		if (status >= 0) {
+			status = setNameRelative(hLink, NT_FILE_RENAME_INFORMATION, hFolder, leaf, true);
+			if (status == NT_STATUS_ACCESS_DENIED && SetFileAttributes(op.name, FILE_ATTRIBUTE_NORMAL)) {
+				status = setNameRelative(hLink, NT_FILE_RENAME_INFORMATION, hFolder, leaf, true);
 			}
+			CloseHandle(hLink);
+		}
+		if (status < 0) {
+			logError(L"Unable to replace file by hard link: 0x%08X", status);
+			LPWSTR fullTemp = Journal::getTempName(op.name, op.sequence);
+			DeleteFile(fullTemp);
+			delete[] fullTemp;
+		}
+		delete[] temp;
+		return status >= 0;
+	}
 
-			// check for junction
-			if (!followJunctions && item.dwFileAttributes&FILE_ATTRIBUTE_REPARSE_POINT) {
-				logDebug(L"ignoring junction");
-				delete fullPath;
-				return;
+	/**
+	* Links all operations of one run, they are in the same folder
+	*/
+	void linkRun(int run) {
+		int volume = linkRunVolumes[run];
+		HANDLE semaphore = volume >= 0 ? linkVolumes[volume].semaphore : NULL;
+		if (semaphore != NULL) {
+			WaitForSingleObject(semaphore, INFINITE);
+		}
+
+		LinkOperation& first = linkOperations[linkRuns[run]];
+		HANDLE hFolder = openLinkFolder(first.name, first.folderLength);
+		HANDLE hTarget = INVALID_HANDLE_VALUE;
+		LPCWSTR openTarget = NULL;
+		for (int i = linkRuns[run]; i < linkRuns[run + 1]; i++) {
+			LinkOperation& op = linkOperations[i];
+			bool linked;
+			// creating the link and renaming it over the name
+			throttleMetadata(2);
+			if (hFolder == INVALID_HANDLE_VALUE) {
+				LPWSTR temp = Journal::getTempName(op.name, op.sequence);
+				linked = hardLinkFiles(op.target, op.name, temp);
+				delete[] temp;
+			} else {
+				// the names of one group follow each other, the target stays open for them
+				if (op.target != openTarget) {
+					if (hTarget != INVALID_HANDLE_VALUE) {
+						CloseHandle(hTarget);
+					}
+					hTarget = CreateFile(op.target, FILE_WRITE_ATTRIBUTES | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+					if (hTarget == INVALID_HANDLE_VALUE) {
+						logError(L"Unable to open file: %i", GetLastError());
+					}
+					openTarget = op.target;
+				}
+				linked = hTarget != INVALID_HANDLE_VALUE && hardLinkRelative(hTarget, hFolder, op);
 			}
+			if (!linked) {
+				logInfo(L"Unable to process links for \"%s\" and \"%s\"", op.target, op.name);
+				op.failed = true;
+			}
+		}
+		if (hTarget != INVALID_HANDLE_VALUE) {
+			CloseHandle(hTarget);
+		}
+		if (hFolder != INVALID_HANDLE_VALUE) {
+			CloseHandle(hFolder);
+		}
 
-			// add the path to the collection
-			addPath(fullPath);
+		if (semaphore != NULL) {
+			ReleaseSemaphore(semaphore, 1, NULL);
+		}
+	}
 
-		} else {
+	/**
+	* Links runs until all are done
+	*/
+	void linkFolders() {
+		LONG run;
+		while ((run = InterlockedIncrement(&nextLinkRun) - 1) < linkRunCount) {
+			linkRun(run);
+		}
+	}
 
-			// check if this is a hidden file
-			if (!hiddenFiles && item.dwFileAttributes&FILE_ATTRIBUTE_HIDDEN) {
-				logDebug(L"ignoring file, hidden attribute is set");
-				delete fullPath;
-				return;
+	static unsigned __stdcall linkThread(void* param) {
+		((DuplicateFileHardLinker*)param)->linkFolders();
+		return 0;
+	}
+
+	static int __cdecl compareFolders(const void* key1, const void* key2) {
+		const LinkOperation* op1 = (const LinkOperation*)key1;
+		const LinkOperation* op2 = (const LinkOperation*)key2;
+		size_t length = op1->folderLength < op2->folderLength ? op1->folderLength : op2->folderLength;
+		int result = _wcsnicmp(op1->name, op2->name, length);
+		if (result == 0 && op1->folderLength != op2->folderLength) {
+			result = op1->folderLength < op2->folderLength ? -1 : 1;
+		}
+		return result;
+	}
+
+	/**
+	* Orders operations by folder, in a folder in journal order
+	*/
+	static int __cdecl compareLinkOperations(const void* key1, const void* key2) {
+		int result = compareFolders(key1, key2);
+		if (result == 0) {
+			DWORD sequence1 = ((const LinkOperation*)key1)->sequence;
+			DWORD sequence2 = ((const LinkOperation*)key2)->sequence;
+			result = sequence1 < sequence2 ? -1 : (sequence1 > sequence2 ? 1 : 0);
+		}
+		return result;
+	}
+
+	/**
+	* Folders linked at once on a file system, as given by the link limits
+	* @return limit, 0 if not limited
+	*/
+	int getLinkLimit(LPCWSTR fileSystem) {
+		size_t length = wcslen(fileSystem);
+		LPCWSTR entry = linkLimits;
+		while (entry != NULL && *entry != 0) {
+			if (_wcsnicmp(entry, fileSystem, length) == 0 && entry[length] == L'=') {
+				return _wtoi(entry + length + 1);
+			}
+			entry = wcschr(entry, L',');
+			if (entry != NULL) {
+				entry++;
 			}
+		}
+		return 0;
+	}
 
-			// check if the file is "big" enough
-			if (!smallFiles && (item.nFileSizeLow > 0) && (item.nFileSizeLow < MIN_FILE_SIZE) && (item.nFileSizeHigh == 0)) {
-				logDebug(L"ignoring file, is too small.");
-				delete fullPath;
-				return;
+	/**
+	* Finds the volume of a name, a new volume gets a semaphore sized by the
+	* limit of its file system
+	* @return index of the volume, -1 if unknown
+	*/
+	int getLinkVolume(LPCWSTR name) {
+		wchar_t path[MAX_PATH];
+		if (!GetVolumePathName(name, path, MAX_PATH)) {
+			return -1;
+		}
+		for (int i = 0; i < linkVolumeCount; i++) {
+			if (_wcsicmp(linkVolumes[i].path, path) == 0) {
+				return i;
 			}
+		}
+		wchar_t fileSystem[MAX_PATH];
+		int limit = 0;
+		if (GetVolumeInformation(path, NULL, 0, NULL, NULL, NULL, fileSystem, MAX_PATH)) {
+			limit = getLinkLimit(fileSystem);
+			if (limit > 0) {
+				logVerbose(L"Linking up to %i folders at once on %s (%s)", limit, path, fileSystem);
+			}
+		}
+		linkVolumes = resizeArray(linkVolumes, linkVolumeCount, linkVolumeCount + 1);
+		LinkVolume& volume = linkVolumes[linkVolumeCount];
+		volume.path = new wchar_t[wcslen(path) + 1];
+		wcscpy(volume.path, path);
+		volume.semaphore = limit > 0 ? CreateSemaphore(NULL, limit, limit, NULL) : NULL;
+		return linkVolumeCount++;
+	}
 
-			// check if this is a system file
-			if (!systemFiles && (item.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM)) {
-				logDebug(L"ignoring file, system attribute is set");
-				delete fullPath;
-				return;
+	/**
+	* Releases the volumes of the link phase
+	*/
+	void deleteLinkVolumes() {
+		for (int i = 0; i < linkVolumeCount; i++) {
+			delete[] linkVolumes[i].path;
+			if (linkVolumes[i].semaphore != NULL) {
+				CloseHandle(linkVolumes[i].semaphore);
+			}
+		}
+		delete[] linkVolumes;
+		linkVolumes = NULL;
+		linkVolumeCount = 0;
+	}
+
+	/**
+	* Links the files of a batch of groups. The intents of all links are
+	* flushed to the journal before the first link is created. The links are
+	* sorted by folder, every folder is opened once and the folders are
+	* linked by parallel threads.
+	* @return bytes saved
+	*/
+	INT64 linkBatch(Journal& journal, Duplicates::Group** batch, int count) {
+		// Step 1: journal the intents
+		int operationCount = 0;
+		for (int j = 0; j < count; j++) {
+			operationCount += batch[j]->count - 1;
+		}
+		linkOperations = new LinkOperation[operationCount];
+		int n = 0;
+		for (int j = 0; j < count; j++) {
+			for (int i = 1; i < batch[j]->count; i++) {
+				journal.addIntent(batch[j]->names[i]);
+				LinkOperation& op = linkOperations[n++];
+				op.group = j;
+				op.target = batch[j]->names[0];
+				op.name = batch[j]->names[i];
+				LPCWSTR leaf = wcsrchr(op.name, L'\\');
+				op.folderLength = leaf != NULL ? leaf + 1 - op.name : 0;
+				op.sequence = journal.getSequence();
+				op.failed = false;
 			}
+		}
+		if (!journal.commit()) {
+			throw L"Unable to write the link journal";
+		}
 
-			// add the file only if it contains data!
-			if ((item.nFileSizeLow > 0) || (item.nFileSizeHigh > 0)) {
-				addFile(fullPath, item);
+		// Step 2: split the operations into runs of one folder
+		qsort(linkOperations, operationCount, sizeof(LinkOperation), compareLinkOperations);
+		linkRuns = new int[operationCount + 1];
+		linkRunVolumes = new int[operationCount];
+		linkRunCount = 0;
+		for (int i = 0; i < operationCount; i++) {
+			if (i == 0 || compareFolders(&linkOperations[i - 1], &linkOperations[i]) != 0) {
+				linkRunVolumes[linkRunCount] = getLinkVolume(linkOperations[i].name);
+				linkRuns[linkRunCount++] = i;
+			}
+		}
+		linkRuns[linkRunCount] = operationCount;
+
+		// Step 3: link the folders in parallel
+		nextLinkRun = 0;
+		int workers = linkThreads < linkRunCount ? linkThreads : linkRunCount;
+		void** params = new void*[workers];
+		for (int i = 0; i < workers; i++) {
+			params[i] = this;
+		}
+		runThreads(linkThread, params, workers);
+		delete[] params;
+		linkCount += operationCount;
+
+		// Step 4: only groups with all names linked count as saved
+		bool* failed = new bool[count];
+		for (int j = 0; j < count; j++) {
+			failed[j] = false;
+		}
+		for (int i = 0; i < operationCount; i++) {
+			if (linkOperations[i].failed) {
+				failed[linkOperations[i].group] = true;
+			}
+		}
+		INT64 saved = 0;
+		for (int j = 0; j < count; j++) {
+			if (!failed[j]) {
+				saved += batch[j]->size * batch[j]->files;
+			}
+			delete batch[j];
+		}
+		delete[] failed;
+		delete[] linkOperations;
+		delete[] linkRuns;
+		delete[] linkRunVolumes;
+		linkOperations = NULL;
+		if (!journal.markDone()) {
+			throw L"Unable to write the link journal";
+		}
+		return saved;
+	}
+
+	/**
+	* Name in the synthetic tree of the link benchmark
+	* @param folder Number of the folder, -1 for the tree itself
+	* @param file Number of the file in the folder, -1 for the folder itself
+	*/
+	void getBenchmarkName(LPWSTR buffer, int folder, int file) {
+		wsprintf(buffer, L"%s\\DFHL.benchmark", benchmarkFolder);
+		if (folder >= 0) {
+			wsprintf(buffer + wcslen(buffer), L"\\%i", folder);
+		}
+		if (file >= 0) {
+			wsprintf(buffer + wcslen(buffer), L"\\%i.dat", file);
+		}
+	}
+
+	/**
+	* Creates the tree of the link benchmark, the target is the file 0 of the
+	* tree itself and all files in the folders are added as one group
+	*/
+	void createBenchmarkTree() {
+		// a tree left by an aborted run is removed first, nothing else has its names
+		removeBenchmarkTree();
+		int count = BENCHMARK_FOLDERS * BENCHMARK_FILES + 1;
+		LPWSTR* names = new LPWSTR[count];
+		int n = 0;
+		LPCWSTR error = NULL;
+		for (int folder = -1; folder < BENCHMARK_FOLDERS && error == NULL; folder++) {
+			wchar_t path[MAX_PATH_LENGTH];
+			getBenchmarkName(path, folder, -1);
+			if (!CreateDirectory(path, NULL)) {
+				error = L"Unable to create folder of the link benchmark";
+				break;
+			}
+			for (int file = 0; file < (folder < 0 ? 1 : BENCHMARK_FILES); file++) {
+				names[n] = new wchar_t[MAX_PATH_LENGTH];
+				getBenchmarkName(names[n], folder, file);
+				HANDLE hFile = CreateFile(names[n++], GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+				DWORD written;
+				BOOL success = hFile != INVALID_HANDLE_VALUE && WriteFile(hFile, "x", 1, &written, NULL);
+				if (hFile != INVALID_HANDLE_VALUE) {
+					CloseHandle(hFile);
+				}
+				if (!success) {
+					error = L"Unable to create file of the link benchmark";
+					break;
+				}
 			}
 		}
-		delete fullPath;
+		if (error != NULL) {
+			DWORD lastError = GetLastError();
+			for (int i = 0; i < n; i++) {
+				delete[] names[i];
+			}
+			delete[] names;
+			removeBenchmarkTree();
+			SetLastError(lastError);
+			throw error;
+		}
+		d->add((LPCWSTR*)names, count, count - 1, 1);
+		for (int i = 0; i < count; i++) {
+			delete[] names[i];
+		}
+		delete[] names;
 	}
 
 	/**
-	* Links two files on hard disk by deleting one and linking the name of this to the other
-	* @param file1 File name of the first file
-	* @param file2 File name of the second file to link to
-	* @return boolean value if operation was successful
+	* Removes the tree of the link benchmark
 	*/
-	bool hardLinkFiles(LPCWSTR file1, LPCWSTR file2) {
-		LPWSTR file2Backup = new wchar_t[MAX_PATH_LENGTH];
+	void removeBenchmarkTree() {
+		wchar_t path[MAX_PATH_LENGTH];
+		for (int folder = BENCHMARK_FOLDERS - 1; folder >= -1; folder--) {
+			for (int file = 0; file < (folder < 0 ? 1 : BENCHMARK_FILES); file++) {
+				getBenchmarkName(path, folder, file);
+				DeleteFile(path);
+			}
+			getBenchmarkName(path, folder, -1);
+			RemoveDirectory(path);
+		}
+	}
 
-		logInfo(L"Linking %s and %s", file1, file2);
+	/**
+	* Shares the clusters of the first file with the second one (block cloning
+	* on ReFS), other than hard links the files stay independent. The file
+	* system does not verify the content, both files must have been compared.
+	* @param file1 File name of the file to share the clusters of
+	* @param file2 File name of the file to be changed
+	* @param previous Identity of the last file cloned, names of the same file are skipped
+	* @return boolean value if operation was successful
+	*/
+	bool cloneFile(LPCWSTR file1, LPCWSTR file2, INT64 size, BY_HANDLE_FILE_INFORMATION& previous) {
+		HANDLE hTarget = CreateFile(file2, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (hTarget == INVALID_HANDLE_VALUE) {
+			logError(L"Unable to open file: %i", GetLastError());
+			return false;
+		}
+		BY_HANDLE_FILE_INFORMATION info;
+		bool identified = GetFileInformationByHandle(hTarget, &info) != FALSE;
+		if (identified
+			&& info.dwVolumeSerialNumber == previous.dwVolumeSerialNumber
+			&& info.nFileIndexHigh == previous.nFileIndexHigh
+			&& info.nFileIndexLow == previous.nFileIndexLow) {
+			logDebug(L"%s is another name of the file cloned before", file2);
+			CloseHandle(hTarget);
+			return true;
+		}
+		// without its identity the file can't be recognized as another name of the next one
+		if (identified) {
+			previous = info;
+		} else {
+			memset(&previous, 0, sizeof(previous));
+		}
 
-		// Step 1: precaution - rename original file
-		wsprintf(file2Backup, L"%s_backup", file2);
-		if (!MoveFile(file2, file2Backup)) {
-			logError(L"Unable to move file to backup: %i", GetLastError());
-			delete file2Backup;
+		logInfo(L"Cloning %s to %s", file1, file2);
+		HANDLE hSource = CreateFile(file1, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (hSource == INVALID_HANDLE_VALUE) {
+			logError(L"Unable to open file: %i", GetLastError());
+			CloseHandle(hTarget);
 			return false;
 		}
 
-		// Step 2: create hard link
-		if (!MyCreateHardLink(file2, file1, NULL)) {
-			logError(L"Unable to create hard link: %i", GetLastError());
-			delete file2Backup;
+		// the ranges must be cluster aligned, the last one may end behind the end of file
+		wchar_t volume[MAX_PATH];
+		DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+		if (!GetVolumePathName(file2, volume, MAX_PATH) ||
+			!GetDiskFreeSpace(volume, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters)) {
+			logError(L"Unable to get cluster size: %i", GetLastError());
+			CloseHandle(hSource);
+			CloseHandle(hTarget);
 			return false;
 		}
+		INT64 clusterSize = (INT64)sectorsPerCluster * bytesPerSector;
+		INT64 end = (size + clusterSize - 1) / clusterSize * clusterSize;
+		INT64 batch = cloneBatchSize / clusterSize * clusterSize;
+		if (batch == 0) {
+			batch = clusterSize;
+		}
 
-		// Step 3: remove backup file (orphan)
-		if (!DeleteFile(file2Backup)) {
-			logError(L"Unable to delete file: %i, trying to change attribute...", GetLastError());
-
-			if (!SetFileAttributes(file2Backup, FILE_ATTRIBUTE_NORMAL) ||
-				!DeleteFile(file2Backup)) {
-
-					logError(L"Finally unable to delete file: %i", GetLastError());
-					delete file2Backup;
-					return false;
+		// cloning counts as a write, the last write time of the file is kept
+		FILETIME lastWrite;
+		GetFileTime(hTarget, NULL, NULL, &lastWrite);
+		bool success = true;
+		DuplicateExtentsData data;
+		data.FileHandle = hSource;
+		for (INT64 offset = 0; offset < end && success; offset += batch) {
+			data.SourceFileOffset = data.TargetFileOffset = offset;
+			data.ByteCount = end - offset < batch ? end - offset : batch;
+			DWORD bytes;
+			if (!DeviceIoControl(hTarget, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &data, sizeof(data), NULL, 0, &bytes, NULL)) {
+				logError(L"Unable to clone file: %i", GetLastError());
+				success = false;
 			}
 		}
-
-		return true;
+		SetFileTime(hTarget, NULL, NULL, &lastWrite);
+		CloseHandle(hSource);
+		CloseHandle(hTarget);
+		return success;
 	}
 
 public:
@@ -715,9 +6839,9 @@ public:
 	*/
 	DuplicateFileHardLinker() {
 		p = new Paths();
-		f = new Files();
+		folders = new Folders();
+		f = new Files(folders);
 		d = new Duplicates();
-		block1 = block2 = NULL;
 		attributeMustMatch = false;
 		hiddenFiles = false;
 		followJunctions = false;
@@ -725,18 +6849,60 @@ public:
 		recursive = false;
 		systemFiles = false;
 		dateTimeMustMatch = false;
+		indexFile = NULL;
+		targetPolicy = MOST_LINKS;
+		preferredRoot = NULL;
+		cloneFiles = false;
+		cloneBatchSize = CLONE_BATCH_SIZE * 1048576;
+		journalFile = NULL;
+		setJournalFile(JOURNAL_FILE);
+		linkLimits = NULL;
+		benchmarkFolder = NULL;
+		memoryLimit = 0;
+		runs = NULL;
+		physicalOrder = false;
+		bufferBudget = (size_t)BUFFER_BUDGET * 1048576;
+		throttle = NULL;
+		locations = NULL;
+		groupOrder = NULL;
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		threadCount = systemInfo.dwNumberOfProcessors > 0 ? systemInfo.dwNumberOfProcessors : 1;
+		linkThreads = threadCount;
+		readAhead = READ_AHEAD;
+		mapThreshold = (INT64)MAP_THRESHOLD * 1048576;
+		getFileInformationByHandleEx = (GetFileInformationByHandleExProc)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "GetFileInformationByHandleEx");
+		getVolumeInformationByHandle = (GetVolumeInformationByHandleProc)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "GetVolumeInformationByHandleW");
+		getPerformanceInfo = (GetPerformanceInfoProc)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "K32GetPerformanceInfo");
+		if (getPerformanceInfo == NULL) {
+			HMODULE psapi = LoadLibrary(L"psapi.dll");
+			getPerformanceInfo = psapi != NULL ? (GetPerformanceInfoProc)GetProcAddress(psapi, "GetPerformanceInfo") : NULL;
+		}
+		cacheNeutral = false;
+		hashMethod = NO_HASH;
+		verifyHash = false;
+		batchLimit = (INT64)BATCH_FILE_SIZE * 1024;
+		enumeration = FIND_FILES;
+		walkedItems = 0;
+		walkers = NULL;
+		foldersQueued = NULL;
+		groupResults = NULL;
+		linkOperations = NULL;
+		linkVolumes = NULL;
+		linkVolumeCount = 0;
 	}
 
 	~DuplicateFileHardLinker() {
 		delete p;
 		delete f;
+		delete folders;
 		delete d;
-		if (block1 != NULL) {
-			delete block1;
-		}
-		if (block2 != NULL) {
-			delete block2;
-		}
+		delete[] indexFile;
+		delete[] preferredRoot;
+		delete[] journalFile;
+		delete[] linkLimits;
+		delete[] benchmarkFolder;
+		delete throttle;
 	}
 
 	/**
@@ -788,6 +6954,220 @@ public:
 		dateTimeMustMatch = newValue;
 	}
 
+	/**
+	* Setter for the number of worker threads
+	*/
+	void setThreadCount(int newValue) {
+		threadCount = newValue;
+	}
+
+	/**
+	* Setter for the number of reads in flight per file
+	*/
+	void setReadAhead(int newValue) {
+		readAhead = newValue;
+	}
+
+	/**
+	* Setter for the size up to which files are compared memory mapped, -1 for all files
+	*/
+	void setMapThreshold(INT64 newValue) {
+		mapThreshold = newValue;
+	}
+
+	/**
+	* Setter for the file name of the hash index
+	*/
+	void setIndexFile(LPCWSTR newValue) {
+		delete[] indexFile;
+		indexFile = new wchar_t[wcslen(newValue) + 1];
+		wcscpy(indexFile, newValue);
+	}
+
+	/**
+	* Setter for the file name of the journal of the link phase
+	*/
+	void setJournalFile(LPCWSTR newValue) {
+		delete[] journalFile;
+		journalFile = new wchar_t[wcslen(newValue) + 1];
+		wcscpy(journalFile, newValue);
+	}
+
+	/**
+	* Setter for the number of threads linking folders in parallel
+	*/
+	void setLinkThreads(int newValue) {
+		linkThreads = newValue;
+	}
+
+	/**
+	* Setter for the folders linked at once per file system, like "NTFS=8,ReFS=16"
+	* @return boolean value if every entry names a file system and a limit between 1 and MAX_THREADS
+	*/
+	bool setLinkLimits(LPCWSTR newValue) {
+		// every entry needs a file system name and a positive number of folders
+		LPCWSTR entry = newValue;
+		while (true) {
+			LPCWSTR equals = wcschr(entry, L'=');
+			LPCWSTR end = wcschr(entry, L',');
+			if (end == NULL) {
+				end = entry + wcslen(entry);
+			}
+			if (equals == NULL || equals == entry || equals > end || equals + 1 == end) {
+				return false;
+			}
+			int limit = 0;
+			for (LPCWSTR digit = equals + 1; digit < end; digit++) {
+				if (*digit < L'0' || *digit > L'9') {
+					return false;
+				}
+				limit = limit * 10 + (*digit - L'0');
+				if (limit > MAX_THREADS) {
+					return false;
+				}
+			}
+			if (limit < 1) {
+				return false;
+			}
+			if (*end == 0) {
+				break;
+			}
+			entry = end + 1;
+		}
+		delete[] linkLimits;
+		linkLimits = new wchar_t[wcslen(newValue) + 1];
+		wcscpy(linkLimits, newValue);
+		return true;
+	}
+
+	/**
+	* Setter for the bytes the file table may take, 0 for no limit
+	*/
+	void setMemoryLimit(size_t newValue) {
+		memoryLimit = newValue;
+	}
+
+	/**
+	* Sets the limits of the reads and metadata operations, like "bytes=50M,reads=200,meta=500"
+	* @return boolean value if the limits could be parsed
+	*/
+	bool setThrottleLimits(LPCWSTR newValue) {
+		if (throttle == NULL) {
+			throttle = new Throttle();
+		}
+		return throttle->parse(newValue);
+	}
+
+	/**
+	* Setter for the file the limits are read from at runtime
+	*/
+	void setThrottleFile(LPCWSTR newValue) {
+		if (throttle == NULL) {
+			throttle = new Throttle();
+		}
+		throttle->setControlFile(newValue);
+	}
+
+	/**
+	* Waits for the limit of metadata operations
+	*/
+	void throttleMetadata(int operations) {
+		if (throttle != NULL) {
+			throttle->acquire(Throttle::METADATA_OPERATIONS, operations);
+		}
+	}
+
+	/**
+	* Setter for the flag to compare without the file cache
+	*/
+	void setCacheNeutral(bool newValue) {
+		cacheNeutral = newValue;
+	}
+
+	/**
+	* Setter for the content hash the files are grouped by
+	*/
+	void setHashMethod(HashMethod newValue) {
+		hashMethod = newValue;
+	}
+
+	/**
+	* Setter for the flag to compare byte by byte besides the hash
+	*/
+	void setVerifyHash(bool newValue) {
+		verifyHash = newValue;
+	}
+
+	/**
+	* Setter for the size up to which files are read whole in one batch per group, 0 for none
+	*/
+	void setBatchLimit(INT64 newValue) {
+		batchLimit = newValue;
+	}
+
+	/**
+	* Setter for the bytes of the read buffers of all compare threads
+	*/
+	void setBufferBudget(size_t newValue) {
+		bufferBudget = newValue;
+	}
+
+	/**
+	* Setter for the flag to compare in the order of the physical location of the files
+	*/
+	void setPhysicalOrder(bool newValue) {
+		physicalOrder = newValue;
+	}
+
+	/**
+	* Setter for the folder the tree of the link benchmark is created in
+	*/
+	void setBenchmarkFolder(LPCWSTR newValue) {
+		delete[] benchmarkFolder;
+		benchmarkFolder = new wchar_t[wcslen(newValue) + 1];
+		wcscpy(benchmarkFolder, newValue);
+	}
+
+	/**
+	* Completes or rolls back the links left incomplete in the journal
+	*/
+	void recoverLinks() {
+		logInfo(L"Recovering links from journal \"%s\"", journalFile);
+		int recovered = Journal::recover(journalFile);
+		if (recovered < 0) {
+			throw L"Recovery incomplete, the journal is kept";
+		}
+		logInfo(L"Recovery done, %i incomplete links found.", recovered);
+	}
+
+	/**
+	* Setter for the clone flag, duplicates share their clusters instead of being hard linked
+	*/
+	void setCloneFiles(bool newValue) {
+		cloneFiles = newValue;
+	}
+
+	/**
+	* Setter for the bytes cloned with one call
+	*/
+	void setCloneBatchSize(DWORD newValue) {
+		cloneBatchSize = newValue;
+	}
+
+	/**
+	* Setter for the policy choosing the file all equal files are linked to
+	* @param newRoot Folder the target should be below with PREFERRED_ROOT, NULL otherwise
+	*/
+	void setTargetPolicy(TargetPolicy newPolicy, LPCWSTR newRoot) {
+		targetPolicy = newPolicy;
+		delete[] preferredRoot;
+		preferredRoot = NULL;
+		if (newRoot != NULL) {
+			preferredRoot = new wchar_t[wcslen(newRoot) + 1];
+			wcscpy(preferredRoot, newRoot);
+		}
+	}
+
 	/**
 	* Adds a path to the collection of path's to process
 	* @param path Path to add to the collection
@@ -801,142 +7181,384 @@ public:
 	*/
 	void findDuplicates() {
 		// Step 1: Walk through the directory tree
-		logInfo(L"Parsing Directory Tree...");
-		LPWSTR folder = new wchar_t[MAX_PATH_LENGTH];
-		while (p->pop(folder)) {
-			logVerbose(L"Parsing Folder %s", folder);
-
-			WIN32_FIND_DATA FindFileData;
-			HANDLE hFind = INVALID_HANDLE_VALUE;
-			wchar_t DirSpec[MAX_PATH_LENGTH];  // directory specification
-			DWORD dwError;
+		enumeration = getBestEnumeration();
+		if (memoryLimit > 0) {
+			runs = new FileRuns(memoryLimit, threadCount);
+		}
+		walkTree();
+
+		// Step 2: Prepare the compare workers
+		HashIndex* index = NULL;
+		if (indexFile != NULL) {
+			index = new HashIndex();
+			if (!index->open(indexFile)) {
+				logInfo(L"Continuing without index.");
+				delete index;
+				index = NULL;
+			}
+		}
+		IoScheduler scheduler;
+		scheduler.setThrottle(throttle);
+		BufferPool pool(bufferBudget);
+		compareError = NULL;
+		InitializeCriticalSection(&compareLock);
+		// helpers for every other processor hash the chunks of large blocks, independent of the
+		// compare threads: while those wait for reads or few groups are left, the processors are free
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		HelperThreads hashHelpers(hashMethod == BLAKE3_HASH ? (int)systemInfo.dwNumberOfProcessors - 1 : 0);
+		if (hashMethod != NO_HASH) {
+			logVerbose(L"Grouping files by their %s hash%s, %i helper threads for large blocks.",
+				hashMethod == BLAKE3_HASH ? L"BLAKE3" : L"MurmurHash3", verifyHash ? L" and byte compare" : L"", hashHelpers.getThreadCount());
+		}
+		CompareWorker* workers = new CompareWorker[threadCount];
+		for (int i = 0; i < threadCount; i++) {
+			workers[i].owner = this;
+			workers[i].comparer = new GroupComparer(attributeMustMatch, dateTimeMustMatch, index, &scheduler, &pool);
+			workers[i].comparer->setReadAhead(readAhead);
+			// unbuffered reads bypass the file cache, mapped views go through it
+			workers[i].comparer->setMapThreshold(cacheNeutral ? 0 : mapThreshold);
+			workers[i].comparer->setTargetPolicy(targetPolicy, preferredRoot);
+			workers[i].comparer->setHashMethod(hashMethod, verifyHash, &hashHelpers);
+			workers[i].comparer->setBatchLimit(batchLimit);
+			workers[i].folderCache = ntOpenFile != NULL ? new FolderCache(folders) : NULL;
+		}
 
-			size_t len = wcslen(wcsncpy(DirSpec, folder, wcslen(folder)+1));
-			// Do not append backslash if this is already the last character!
-			if(DirSpec[len] != L'\\')
-				wcsncat(DirSpec, L"\\", 2);
-			wcsncat(DirSpec, L"*", 2);
+		// Step 3: Group the files by size, only sizes with two or more files are candidates, and compare them
+		SIZE_T cachePages = getSystemCachePages();
+		if (runs == NULL) {
+			logInfo(L"Found %i Files in folders, building size index.", f->getSize());
+			f->buildSizeIndex();
+			logVerbose(L"%i names are hard links of files found before, they are not compared.", f->getAliasCount());
+			logInfo(L"%i candidate groups with %I64i bytes remain, comparing relevant files.", f->getGroupCount(), f->getGroupBytes());
+			compareCandidates(workers);
+		} else {
+			// the size groups are merged from the runs and compared chunk by chunk
+			logInfo(L"Found %I64i Files in folders, merging %i sorted runs.", runs->getRecordCount(), runs->getRunCount());
+			runs->startMerge();
+			while (compareError == NULL && runs->readGroups(f)) {
+				f->buildSizeIndex();
+				logVerbose(L"%i candidate groups with %I64i bytes read from the runs, comparing relevant files.", f->getGroupCount(), f->getGroupBytes());
+				compareCandidates(workers);
+				delete f;
+				f = new Files(folders);
+			}
+			delete runs;
+			runs = NULL;
+		}
 
-			hFind = FindFirstFile(DirSpec, &FindFileData);
+		INT64 eliminated[GroupComparer::STAGE_COUNT];
+		INT64 indexPrints = 0;
+		INT64 indexDigests = 0;
+		INT64 holeBytes = 0;
+		INT64 cachedBytes = 0;
+		INT64 smallFiles[2] = { 0, 0 };
+		INT64 smallTicks[2] = { 0, 0 };
+		for (int stage = 0; stage < GroupComparer::STAGE_COUNT; stage++) {
+			eliminated[stage] = 0;
+		}
+		for (int i = 0; i < threadCount; i++) {
+			for (int stage = 0; stage < GroupComparer::STAGE_COUNT; stage++) {
+				eliminated[stage] += workers[i].comparer->getEliminated((GroupComparer::Stage)stage);
+			}
+			indexPrints += workers[i].comparer->getIndexPrints();
+			indexDigests += workers[i].comparer->getIndexDigests();
+			holeBytes += workers[i].comparer->getHoleBytes();
+			cachedBytes += workers[i].comparer->getCachedBytes();
+			for (int b = 0; b < 2; b++) {
+				smallFiles[b] += workers[i].comparer->getSmallFiles(b == 1);
+				smallTicks[b] += workers[i].comparer->getSmallTicks(b == 1);
+			}
+			delete workers[i].comparer;
+			delete workers[i].folderCache;
+		}
+		delete[] workers;
+		logInfo(L"Candidates eliminated: %I64i by head, %I64i by tail, %I64i by samples, %I64i by full compare.",
+			eliminated[GroupComparer::HEAD_STAGE],
+			eliminated[GroupComparer::TAIL_STAGE],
+			eliminated[GroupComparer::SAMPLE_STAGE],
+			eliminated[GroupComparer::FULL_STAGE]);
+		if (holeBytes > 0) {
+			logInfo(L"Skipped %I64i bytes of holes in sparse files.", holeBytes);
+		}
 
-			if (hFind == INVALID_HANDLE_VALUE) {
-				// Accessing "<drive>:\System Volume Information\*" gives an
-				// ERROR_ACCESS_DENIED. So this has to be fixed to scan whole
-				// volumes! Also can happen on folders with no access permissions.
-				logError(GetLastError(), L"Unable to read folder content.");
-			} else {
-				addItem(folder, FindFileData);
-				while (FindNextFile(hFind, &FindFileData) != 0) {
-					addItem(folder, FindFileData);
-				}
-
-				dwError = GetLastError();
-				FindClose(hFind);
-				if (dwError != ERROR_NO_MORE_FILES) {
-					LPWSTR buffer = new wchar_t[TEMP_BUFFER_LENGTH];
-					wsprintf(buffer, L"FindNextFile error. Error is %u\n", dwError);
-					throw buffer;
-				}
-			}
-		}
-
-		// Step 2: Walk over all relevant files
-		logInfo(L"Found %i Files in folders, comparing relevant files.", f->getSize());
-		LPWSTR file1 = new wchar_t[MAX_PATH_LENGTH];
-		INT64 size1;
-		LPWSTR file2 = new wchar_t[MAX_PATH_LENGTH];
-		INT64 size2;
-		bool duplicateChecked;
-		while (f->pop(file1, size1)) {
-			duplicateChecked = false;
-			for (int i = 0; i < f->getSize() && !duplicateChecked; i++) {
-				f->next(file2, size2);
-				if (size1 == size2) {
-					logVerbose(L"File \"%s\" and \"%s\" have both size of %I64i comparing...", file1, file2, size1);
-
-					// Compare the both files with same size
-					DWORD start = GetTickCount();
-					DWORD time = 0;
-					switch (compareFiles(file1, file2, size1))
-					{
-					case EQUAL:
-						time = GetTickCount() - start;
-						logDebug(L"file compare took %ims, %I64i KB/s", time, time>0?size1*2*1000 / time / 1024:0);
-
-						// Files seem to be equal, marking them for later processing...
-						addDuplicate(file1, file2, size1);
-						duplicateChecked = true;
-						break;
-					case SAME:
-						// In case the files are already hard linked, we skip further checks and check the second file later...
-						duplicateChecked = true;
-						break;
-					case SKIP:
-						// okay, it seems that this pair should not be processed...
-						duplicateChecked = true;
-						break;
-					case DIFFERENT:
-						// yeah, just do nothing.
-						break;
-					}
-				}
+		// files per second of compare thread time, /S:0 compares the small files block by block for reference
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		for (int b = 1; b >= 0; b--) {
+			if (smallFiles[b] > 0) {
+				logVerbose(L"Files up to %i KB %s: %I64i in %I64ims, %I64i files/s per thread.", FIRST_BLOCK_SIZE / 1024,
+					b == 1 ? L"read whole in batches" : L"compared block by block", smallFiles[b], smallTicks[b] * 1000 / frequency.QuadPart,
+					smallTicks[b] > 0 ? smallFiles[b] * frequency.QuadPart / smallTicks[b] : 0);
 			}
 		}
+		if (throttle != NULL) {
+			logInfo(L"Threads waited %ims in total for the limits while comparing.", throttle->getWaited());
+		}
+		logVerbose(L"Read buffers took up to %u KB of the budget of %u KB.", (DWORD)(pool.getPeak() / 1024), (DWORD)(bufferBudget / 1024));
+
+		// every page read through the cache may have displaced a page of another process
+		INT64 cachedPages = (cachedBytes + systemInfo.dwPageSize - 1) / systemInfo.dwPageSize;
+		if (cacheNeutral) {
+			logInfo(L"Cache neutral compare: %I64i pages read through the file cache, system file cache went from %I64i to %I64i pages.",
+				cachedPages, (INT64)cachePages, (INT64)getSystemCachePages());
+		} else {
+			logVerbose(L"%I64i pages read through the file cache, at most as many cached pages displaced.", cachedPages);
+		}
+		if (index != NULL) {
+			logInfo(L"Taken from index: %I64i fingerprints, %I64i content hashes.", indexPrints, indexDigests);
+			index->close();
+			delete index;
+		}
+		DeleteCriticalSection(&compareLock);
+		if (compareError != NULL) {
+			throw compareError;
+		}
 
-		// Step 3: Show search results
+		// Step 4: Show search results
 		logInfo(L"Found %i duplicate files, savings of %I64i bytes possible.", d->getFileCount(), d->getByteSum());
+	}
 
-		delete file2;
-		delete file1;
-		delete folder;
+	/**
+	* Pages of the system file cache
+	* @return number of pages, 0 if not known
+	*/
+	SIZE_T getSystemCachePages() {
+		PerformanceInformation info;
+		info.cb = sizeof(info);
+		if (getPerformanceInfo == NULL || !getPerformanceInfo(&info, sizeof(info))) {
+			return 0;
+		}
+		return info.SystemCache;
+	}
+
+	/**
+	* Compares the candidate groups of the file table with all workers
+	*/
+	void compareCandidates(CompareWorker* workers) {
+		DWORD start = GetTickCount();
+		nextGroup = 0;
+		groupResults = new Duplicates*[f->getGroupCount() > 0 ? f->getGroupCount() : 1];
+		for (int group = 0; group < f->getGroupCount(); group++) {
+			groupResults[group] = NULL;
+		}
+		void** params = new void*[threadCount];
+		for (int i = 0; i < threadCount; i++) {
+			params[i] = &workers[i];
+		}
+
+		// the locations of all files are needed to order the groups before the first is compared
+		INT64 tableDistance = 0;
+		INT64 physicalDistance = 0;
+		if (physicalOrder) {
+			locations = new INT64[f->getSize() > 0 ? f->getSize() : 1];
+			runThreads(locateThread, params, threadCount);
+			orderGroups();
+			tableDistance = getSeekDistance(false);
+			physicalDistance = getSeekDistance(true);
+			nextGroup = 0;
+		}
+		runThreads(compareThread, params, threadCount);
+		delete[] params;
+
+		// keep the results in group order, independent of the compare workers
+		for (int group = 0; group < f->getGroupCount(); group++) {
+			if (groupResults[group] != NULL) {
+				d->merge(groupResults[group]);
+				delete groupResults[group];
+			}
+		}
+		delete[] groupResults;
+		groupResults = NULL;
+		DWORD time = GetTickCount() - start;
+		logVerbose(L"Compared %i groups with %i threads in %ims", f->getGroupCount(), threadCount, time);
+		if (physicalOrder) {
+			logInfo(L"Compared in physical order in %ims, seek distance estimate %I64i clusters instead of %I64i in table order.", time, physicalDistance, tableDistance);
+			delete[] locations;
+			locations = NULL;
+			delete[] groupOrder;
+			groupOrder = NULL;
+		}
 	}
 
 	/**
 	* Processes all duplicates and crestes hard links of the files
 	*/
 	void linkAllDuplicates() {
-		LPWSTR file1 = new wchar_t[MAX_PATH_LENGTH];
-		LPWSTR file2 = new wchar_t[MAX_PATH_LENGTH];
-		INT64 size;
 		INT64 sumSize = 0;
 
 		if (d->getSize() > 0) {
-			// Loop over all found files...
-			logInfo(L"Hard linking %i duplicate files", d->getSize());
-			while (d->pop(file1, file2, size)) {
-				sumSize += size;
-				if (!hardLinkFiles(file1, file2)) {
-					logInfo(L"Unable to process links for \"%s\" and \"%s\"", file1, file2);
+			// Loop over all found groups, every name is linked to the target once
+			logInfo(L"%s %i duplicate files", cloneFiles ? L"Cloning" : L"Hard linking", d->getFileCount());
+			DWORD start = GetTickCount();
+			linkCount = 0;
+
+			// cloning leaves the names in place and needs no journal
+			Journal journal;
+			if (!cloneFiles && !journal.open(journalFile)) {
+				throw L"";
+			}
+			Duplicates::Group** batch = new Duplicates::Group*[JOURNAL_BATCH];
+			int batchGroups = 0;
+			int batchNames = 0;
+			Duplicates::Group* g;
+			while ((g = d->pop()) != NULL) {
+				if (!cloneFiles) {
+					batch[batchGroups++] = g;
+					batchNames += g->count - 1;
+					if (batchGroups == JOURNAL_BATCH || batchNames >= JOURNAL_BATCH) {
+						sumSize += linkBatch(journal, batch, batchGroups);
+						batchGroups = batchNames = 0;
+					}
+					continue;
 				}
+				bool linked = true;
+				BY_HANDLE_FILE_INFORMATION previous;
+				memset(&previous, 0, sizeof(previous));
+				for (int i = 1; i < g->count; i++) {
+					throttleMetadata(1);
+					if (!cloneFile(g->names[0], g->names[i], g->size, previous)) {
+						logInfo(L"Unable to process links for \"%s\" and \"%s\"", g->names[0], g->names[i]);
+						linked = false;
+					}
+				}
+				if (linked) {
+					sumSize += g->size * g->files;
+				}
+				delete g;
+			}
+			if (batchGroups > 0) {
+				sumSize += linkBatch(journal, batch, batchGroups);
+			}
+			delete[] batch;
+			journal.close();
+			deleteLinkVolumes();
+			DWORD time = GetTickCount() - start;
+			if (throttle != NULL) {
+				logInfo(L"Threads waited %ims in total for the limits so far.", throttle->getWaited());
+			}
+			if (cloneFiles) {
+				logInfo(L"Cloning done, %I64i bytes shared in %ims, %I64i KB/s.", sumSize, time, time>0?sumSize*1000 / time / 1024:0);
+			} else {
+				logVerbose(L"Linked %i files with %i threads in %ims, %I64i links/s", linkCount, linkThreads, time, time>0?(INT64)linkCount*1000 / time:0);
+				logInfo(L"Hard linking done, %I64i bytes saved.", sumSize);
 			}
-			logInfo(L"Hard linking done, %I64i bytes saved.", sumSize);
 		} else {
 			logInfo(L"No files found for linking");
 		}
+	}
+
+	/**
+	* Measures the links per second of the link phase for a growing number of
+	* threads, the synthetic tree is created again for each round
+	*/
+	void benchmarkLinks() {
+		logInfo(L"Benchmarking the link phase in \"%s\"", benchmarkFolder);
+		int maxThreads = linkThreads;
+		int threads = 1;
+		while (true) {
+			createBenchmarkTree();
+			linkThreads = threads;
+
+			// the links of each file are not of interest here
+			int oldLevel = logLevel;
+			logLevel = LOG_ERROR;
+			DWORD start = GetTickCount();
+			try {
+				linkAllDuplicates();
+			} catch (LPCWSTR) {
+				logLevel = oldLevel;
+				removeBenchmarkTree();
+				throw;
+			}
+			DWORD time = GetTickCount() - start;
+			logLevel = oldLevel;
+			removeBenchmarkTree();
+			logInfo(L"%i threads: %i links in %ims, %I64i links/s", threads, linkCount, time, time>0?(INT64)linkCount*1000 / time:0);
+
+			if (threads >= maxThreads) {
+				break;
+			}
+			threads = threads * 2 < maxThreads ? threads * 2 : maxThreads;
+		}
+		linkThreads = maxThreads;
+	}
+
+	/**
+	* Fastest directory enumeration available
+	*/
+	EnumerationMethod getBestEnumeration() {
+		if (ntQueryDirectoryFile != NULL && ntOpenFile != NULL) {
+			return FILE_ID_FULL_INFO;
+		}
+		return getFileInformationByHandleEx != NULL ? FILE_ID_BOTH_INFO : FIND_FILES;
+	}
+
+	/**
+	* Measures the entries per second of each directory enumeration method
+	* available on the paths to process, the files found are not compared
+	*/
+	void benchmarkWalk() {
+		int count = 0;
+		LPWSTR* paths = new LPWSTR[p->getSize() + 1];
+		LPWSTR path = new wchar_t[MAX_PATH_LENGTH];
+		while (p->pop(path)) {
+			paths[count] = new wchar_t[wcslen(path) + 1];
+			wcscpy(paths[count++], path);
+		}
+		delete[] path;
+
+		for (int method = FIND_FILES; method <= getBestEnumeration(); method++) {
+			if (method == FILE_ID_BOTH_INFO && getFileInformationByHandleEx == NULL) {
+				continue;
+			}
+			for (int i = count - 1; i >= 0; i--) {
+				p->add(paths[i]);
+			}
+			enumeration = (EnumerationMethod)method;
+			DWORD start = GetTickCount();
+			walkTree();
+			DWORD time = GetTickCount() - start;
+			static const LPCWSTR names[] = { L"FindFirstFile", L"GetFileInformationByHandleEx", L"NtQueryDirectoryFile" };
+			logInfo(L"%s: %I64i entries in %ims, %I64i entries/s", names[method], walkedItems, time, time>0?walkedItems*1000 / time:0);
+
+			// the next method starts with an empty table
+			delete f;
+			delete folders;
+			folders = new Folders();
+			f = new Files(folders);
+		}
 
-		delete file2;
-		delete file1;
+		for (int i = 0; i < count; i++) {
+			delete[] paths[i];
+		}
+		delete[] paths;
 	}
 
 	/**
 	* Displays the result duplicate list to stdout
 	*/
 	void listDuplicates() {
-		LPWSTR file1 = new wchar_t[MAX_PATH_LENGTH];
-		LPWSTR file2 = new wchar_t[MAX_PATH_LENGTH];
-		INT64 size;
-
-		if (d->next(file1, file2, size)) {
+		Duplicates::Group* g = d->next();
+		if (g != NULL) {
 			logInfo(L"Result of duplicate analysis:");
 			do {
-				logInfo(L"%I64i bytes: %s = %s", size, file1, file2);
-			} while (d->next(file1, file2, size));
+				if (g->digest.method != NO_HASH) {
+					// the content hash of the group, for other tools
+					wchar_t hex[BLAKE3_DIGEST_SIZE * 2 + 1];
+					int digestSize = g->digest.method == BLAKE3_HASH ? BLAKE3_DIGEST_SIZE : HASH_DIGEST_SIZE;
+					for (int k = 0; k < digestSize; k++) {
+						wsprintf(hex + k * 2, L"%02x", g->digest.bytes[k]);
+					}
+					logInfo(L"%s:%s %I64i bytes: %s", g->digest.method == BLAKE3_HASH ? L"blake3" : L"murmur3", hex, g->size, g->names[0]);
+				}
+				for (int i = 1; i < g->count; i++) {
+					logInfo(L"%I64i bytes: %s = %s", g->size, g->names[0], g->names[i]);
+				}
+			} while ((g = d->next()) != NULL);
 		} else {
 			logInfo(L"No duplicates to list.");
 		}
-
-		delete file2;
-		delete file1;
 	}
 };
 
@@ -972,31 +7594,63 @@ bool parseCommandLine(int argc, char* argv[], DuplicateFileHardLinker* prog) {
 					logInfo(L"Options:");
 					logInfo(L"/?\tShows this help screen");
 					logInfo(L"/a\tFile attributes must match for linking");
+					logInfo(L"/b:n\tSize in MB of the ranges cloned with one call, default is %i", CLONE_BATCH_SIZE);
+					logInfo(L"/B:n\tMemory in MB of the read buffers of all compare threads, default is %i", BUFFER_BUDGET);
+					logInfo(L"/c:file\tKeep fingerprints and content hashes in an index file, files unchanged since an earlier run are not read again");
+					logInfo(L"/C\tCache neutral compare for busy hosts: all files are read unbuffered, reports the cached pages displaced");
 					logInfo(L"/d\tDebug Mode");
+					logInfo(L"/e\tWith /l, let duplicates share their clusters (block cloning on ReFS) instead of hard linking them");
+					logInfo(L"/f:x\tFolders linked at once per file system, like NTFS=8,ReFS=16, default is no limit");
+					logInfo(L"/g:x\tFile kept of equal files: links (most hard links, default), oldest, or an existing folder it should be below");
 					logInfo(L"/h\tProcess hidden files");
+					logInfo(L"/H:x\tGroup files by a hash of their whole content instead of comparing them byte by byte: murmur (fast) or blake3 (cryptographic), /o lists the hashes");
+					logInfo(L"/i:n\tNumber of reads in flight per file while comparing, default is %i", READ_AHEAD);
 					logInfo(L"/j\tAlso follow junctions (=reparse points) in filesystem");
+					logInfo(L"/k:file\tJournal of the links in progress, default is %s", JOURNAL_FILE);
+					logInfo(L"/K\tMeasure the throughput of each compare kernel, nothing is compared");
+					logInfo(L"/L:x\tLimits per second of the bytes read, the reads and the metadata operations of compare and link, like bytes=50M,reads=200,meta=500");
 					logInfo(L"/l\tHard links for files. If not specified, tool will just read (test) for duplicates");
 					logInfo(L"/m\tAlso Process small files <1024 bytes, they are skipped by default");
+					logInfo(L"/n:n\tNumber of threads linking folders in parallel, default is the number of processors");
 					logInfo(L"/o\tList duplicate file result to stdout");
+					logInfo(L"/p:n\tNumber of threads walking the directory tree and comparing files, default is the number of processors");
+					logInfo(L"/P\tCompare the groups and read the files of a group in the order of their first cluster on disk, reports the estimated seek distance");
 					logInfo(L"/q\tSilent Mode");
 					logInfo(L"/r\tRuns recursively through the given folder list");
 					logInfo(L"/s\tProcess system files");
+					logInfo(L"/S:n\tFiles up to n KB are read whole in one batch per group and grouped in memory, 0 for none, default is %i", BATCH_FILE_SIZE);
 					logInfo(L"/t\tTime + Date of files must match");
+					logInfo(L"/T:file\tControl file of the limits like /L, changes take effect while running");
+					logInfo(L"/u\tMeasure the entries per second of each directory enumeration method on the given folders, nothing is compared");
 					logInfo(L"/v\tVerbose Mode");
+					logInfo(L"/V\tWith /H, compare the files byte by byte as well");
+					logInfo(L"/w:n\tCompare files up to n MB through memory mapped views, * for all files, 0 for none, default is %i", MAP_THRESHOLD);
+					logInfo(L"/x\tRecover the links left incomplete in the journal by a crash, no folders are processed");
+					logInfo(L"/y:folder\tMeasure the links per second of the link phase for growing numbers of threads in a synthetic tree below the folder, no folders are processed");
+					logInfo(L"/z:n\tKeep the file table below n MB, files are spilled to sorted runs in the temp folder, default is no limit");
 					throw L""; //just to terminate the program...
 					break;
 				case 'a':
 					prog->setAttributeMustMatch(true);
 					break;
+				case 'C':
+					prog->setCacheNeutral(true);
+					break;
 				case 'd':
 					logLevel = LOG_DEBUG;
 					break;
+				case 'e':
+					prog->setCloneFiles(true);
+					break;
 				case 'h':
 					prog->setHiddenFiles(true);
 					break;
 				case 'j':
 					prog->setFollowJunctions(true);
 					break;
+				case 'K':
+					kernelBenchmark = true;
+					break;
 				case 'l':
 					reallyLink = true;
 					break;
@@ -1006,6 +7660,9 @@ bool parseCommandLine(int argc, char* argv[], DuplicateFileHardLinker* prog) {
 				case 'o':
 					outputList = true;
 					break;
+				case 'P':
+					prog->setPhysicalOrder(true);
+					break;
 				case 'q':
 					logLevel = LOG_ERROR;
 					break;
@@ -1018,9 +7675,136 @@ bool parseCommandLine(int argc, char* argv[], DuplicateFileHardLinker* prog) {
 				case 't':
 					prog->setDateMatch(true);
 					break;
+				case 'u':
+					walkBenchmark = true;
+					break;
 				case 'v':
 					logLevel = LOG_VERBOSE;
 					break;
+				case 'V':
+					prog->setVerifyHash(true);
+					break;
+				case 'x':
+					recoverJournal = true;
+					break;
+				default:
+					logError(L"Illegal Command line option! Use /? to see valid options!");
+					return false;
+				}
+			} else if (strlen(argv[i]) > 3 && argv[i][2] == ':') {
+				// options with a value
+				wchar_t value[MAX_PATH_LENGTH];
+				mbstowcs(value, argv[i] + 3, MAX_PATH_LENGTH);
+				switch (argv[i][1]) {
+				case 'c':
+					prog->setIndexFile(value);
+					break;
+				case 'b':
+					if (_wtoi(value) < 1 || _wtoi(value) > 4095) {
+						logError(L"Clone batch size must be between 1 and 4095 MB!");
+						return false;
+					}
+					prog->setCloneBatchSize((DWORD)_wtoi(value) * 1048576);
+					break;
+				case 'B':
+					if (_wtoi(value) < 1) {
+						logError(L"Read buffer memory must be at least 1 MB!");
+						return false;
+					}
+					prog->setBufferBudget((size_t)_wtoi(value) * 1048576);
+					break;
+				case 'f':
+					if (!prog->setLinkLimits(value)) {
+						logError(L"Link limits must be given like NTFS=8,ReFS=16, each between 1 and %i!", MAX_THREADS);
+						return false;
+					}
+					break;
+				case 'g':
+					if (wcscmp(value, L"links") == 0) {
+						prog->setTargetPolicy(MOST_LINKS, NULL);
+					} else if (wcscmp(value, L"oldest") == 0) {
+						prog->setTargetPolicy(OLDEST, NULL);
+					} else {
+						// anything else is a folder, a typo of the other values must not pass as one
+						DWORD attributes = GetFileAttributes(value);
+						if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+							logError(L"File kept must be links, oldest or an existing folder!");
+							return false;
+						}
+						prog->setTargetPolicy(PREFERRED_ROOT, value);
+					}
+					break;
+				case 'H':
+					if (wcscmp(value, L"murmur") == 0) {
+						prog->setHashMethod(MURMUR_HASH);
+					} else if (wcscmp(value, L"blake3") == 0) {
+						prog->setHashMethod(BLAKE3_HASH);
+					} else {
+						logError(L"Hash must be murmur or blake3!");
+						return false;
+					}
+					break;
+				case 'i':
+					if (_wtoi(value) < 1 || _wtoi(value) > MAX_READ_AHEAD) {
+						logError(L"Number of reads in flight must be between 1 and %i!", MAX_READ_AHEAD);
+						return false;
+					}
+					prog->setReadAhead(_wtoi(value));
+					break;
+				case 'k':
+					prog->setJournalFile(value);
+					break;
+				case 'L':
+					if (!prog->setThrottleLimits(value)) {
+						logError(L"Limits must be given like bytes=50M,reads=200,meta=500!");
+						return false;
+					}
+					break;
+				case 'n':
+					if (_wtoi(value) < 1 || _wtoi(value) > MAX_THREADS) {
+						logError(L"Number of link threads must be between 1 and %i!", MAX_THREADS);
+						return false;
+					}
+					prog->setLinkThreads(_wtoi(value));
+					break;
+				case 'p':
+					if (_wtoi(value) < 1 || _wtoi(value) > MAX_THREADS) {
+						logError(L"Number of threads must be between 1 and %i!", MAX_THREADS);
+						return false;
+					}
+					prog->setThreadCount(_wtoi(value));
+					break;
+				case 'w':
+					if (wcscmp(value, L"*") == 0) {
+						prog->setMapThreshold(-1);
+					} else if (_wtoi(value) < 0) {
+						logError(L"Size for memory mapped compare must not be negative!");
+						return false;
+					} else {
+						prog->setMapThreshold((INT64)_wtoi(value) * 1048576);
+					}
+					break;
+				case 'S':
+					if (_wtoi(value) < 0 || _wtoi(value) > MAX_BATCH_FILE_SIZE) {
+						logError(L"Size for batched reads must be between 0 and %i KB!", MAX_BATCH_FILE_SIZE);
+						return false;
+					}
+					prog->setBatchLimit((INT64)_wtoi(value) * 1024);
+					break;
+				case 'T':
+					prog->setThrottleFile(value);
+					break;
+				case 'y':
+					prog->setBenchmarkFolder(value);
+					linkBenchmark = true;
+					break;
+				case 'z':
+					if (_wtoi(value) < MIN_MEMORY_LIMIT) {
+						logError(L"Memory limit must be at least %i MB!", MIN_MEMORY_LIMIT);
+						return false;
+					}
+					prog->setMemoryLimit((size_t)_wtoi(value) * 1048576);
+					break;
 				default:
 					logError(L"Illegal Command line option! Use /? to see valid options!");
 					return false;
@@ -1051,7 +7835,7 @@ bool parseCommandLine(int argc, char* argv[], DuplicateFileHardLinker* prog) {
 	}
 
 	// check for parameters
-	if (!pathAdded) {
+	if (!pathAdded && !recoverJournal && !linkBenchmark && !kernelBenchmark) {
 		logError(L"You need to specify at least one folder to process!\nUse /? to see valid options!");
 		return false;
 	}
@@ -1082,18 +7866,35 @@ int __cdecl main(int argc, char* argv[])
 		logInfo(L"%s - %s", PROGRAM_VERSION, PROGRAM_AUTHOR);
 		logInfo(L"");
 
-		// find duplicates
-		prog->findDuplicates();
+		if (recoverJournal) {
+			// recover the links of a crashed run, no folders are processed
+			prog->recoverLinks();
+		} else if (linkBenchmark) {
+			loadNativeApi();
+			prog->benchmarkLinks();
+		} else if (walkBenchmark) {
+			loadNativeApi();
+			prog->benchmarkWalk();
+		} else if (kernelBenchmark) {
+			selectCompareKernel();
+			benchmarkCompareKernels();
+		} else {
+			selectCompareKernel();
+			loadNativeApi();
 
-		if (outputList) {
-			prog->listDuplicates();
-		}
+			// find duplicates
+			prog->findDuplicates();
 
-		if (reallyLink) {
-			// link duplicates
-			prog->linkAllDuplicates();
-		} else {
-			logInfo(L"Skipping real linking. To really create hard links, use the /l switch.");
+			if (outputList) {
+				prog->listDuplicates();
+			}
+
+			if (reallyLink) {
+				// link duplicates
+				prog->linkAllDuplicates();
+			} else {
+				logInfo(L"Skipping real linking. To really create hard links, use the /l switch.");
+			}
 		}
 	} catch (LPCWSTR err) {
 		DWORD dwError = GetLastError();